@@ -87,6 +87,11 @@ void adb_reboot_impl(const char *target);
 
 #define A_VERSION 0x01000000
 
+/* Frame data checksum is neither computed nor checked when both sides
+ * support this version */
+
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+
 struct adb_client_s;
 struct adb_service_s;
 struct apacket_s;
@@ -140,6 +145,11 @@ typedef struct adb_client_ops_s {
     int (*write)(struct adb_client_s *client, apacket *p);
     void (*kick)(struct adb_client_s *client);
     void (*close)(struct adb_client_s *client);
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    /* Optional, send frame header followed by payload moved from fd.
+     * Packet is consumed on success, -EAGAIN if nothing was sent */
+    int (*splice)(struct adb_client_s *client, apacket *p, int fd);
+#endif
 } adb_client_ops_t;
 
 typedef struct adb_client_s {
@@ -147,6 +157,7 @@ typedef struct adb_client_s {
     int next_service_id;
     adb_service_t *services;
     uint8_t is_connected;
+    uint8_t skip_checksum;
 #ifdef CONFIG_ADBD_AUTHENTICATION
     uint8_t token[CONFIG_ADBD_TOKEN_SIZE];
 #endif
@@ -168,6 +179,12 @@ int adb_hal_run(adb_context_t *context);
 int adb_fill_connect_data(char *buf, size_t bufsize);
 int adb_hal_random(void *buf, size_t len);
 
+/* Run work_cb in a worker thread. after_work_cb is called from adb thread
+ * once work_cb is done. */
+
+int adb_hal_queue_work(adb_client_t *client, void (*work_cb)(void *arg),
+                       void (*after_work_cb)(void *arg), void *arg);
+
 /* Client */
 
 adb_client_t* adb_create_client(size_t size);
@@ -186,6 +203,9 @@ void adb_send_okay_frame_with_data(adb_client_t *client, apacket *p,
 void adb_send_open_frame(adb_client_t *client, apacket *p,
     unsigned local, unsigned remote, int size);
 void adb_send_data_frame(adb_client_t *client, apacket *p);
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+int adb_send_data_frame_from_fd(adb_client_t *client, apacket *p, int fd);
+#endif
 
 int adb_check_frame_data(apacket *p);
 int adb_check_frame_header(apacket *p);
@@ -17,6 +17,68 @@
 
 #include "adb.h"
 
+/* Extra features advertised to host */
+
+#ifdef CONFIG_ADBD_FILE_HASH
+#define ADBD_FEATURE_SYNC_HASH ",sync_hash"
+#else
+#define ADBD_FEATURE_SYNC_HASH ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_RANGE
+#define ADBD_FEATURE_SYNC_RANGE ",sync_range"
+#else
+#define ADBD_FEATURE_SYNC_RANGE ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+#define ADBD_FEATURE_SYNC_SPARSE ",sync_sparse"
+#else
+#define ADBD_FEATURE_SYNC_SPARSE ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_WALK
+#define ADBD_FEATURE_SYNC_WALK ",sync_walk"
+#else
+#define ADBD_FEATURE_SYNC_WALK ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_OPS
+#define ADBD_FEATURE_SYNC_OPS ",sync_ops"
+#else
+#define ADBD_FEATURE_SYNC_OPS ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+#define ADBD_FEATURE_SYNC_CRC ",sync_crc32c"
+#else
+#define ADBD_FEATURE_SYNC_CRC ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_TREE
+#define ADBD_FEATURE_SYNC_TREE ",sync_tree"
+#else
+#define ADBD_FEATURE_SYNC_TREE ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_DELTA
+#define ADBD_FEATURE_SYNC_DELTA ",sync_delta"
+#else
+#define ADBD_FEATURE_SYNC_DELTA ""
+#endif
+
+#ifdef CONFIG_ADBD_FILE_STORE
+#define ADBD_FEATURE_SYNC_STORE ",sync_store"
+#else
+#define ADBD_FEATURE_SYNC_STORE ""
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+#define ADBD_FEATURE_SHELL_V2 ",shell_v2"
+#else
+#define ADBD_FEATURE_SHELL_V2 ""
+#endif
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -68,7 +130,12 @@ int adb_fill_connect_data(char *buf, size_t bufsize)
 
     remaining -= len;
     buf += len;
-    len = snprintf(buf, remaining, "features=" CONFIG_ADBD_FEATURES);
+    len = snprintf(buf, remaining, "features=" CONFIG_ADBD_FEATURES
+                   ADBD_FEATURE_SYNC_HASH ADBD_FEATURE_SYNC_STORE
+                   ADBD_FEATURE_SYNC_RANGE ADBD_FEATURE_SYNC_TREE
+                   ADBD_FEATURE_SYNC_DELTA ADBD_FEATURE_SYNC_SPARSE
+                   ADBD_FEATURE_SYNC_WALK ADBD_FEATURE_SYNC_OPS
+                   ADBD_FEATURE_SYNC_CRC ADBD_FEATURE_SHELL_V2);
 
     if (len >= remaining) {
         return bufsize;
@@ -30,6 +30,9 @@
 #ifdef CONFIG_ADBD_SOCKET_SERVICE
 #include "tcp_service.h"
 #endif
+#ifdef CONFIG_ADBD_DEV_SERVICE
+#include "dev_service.h"
+#endif
 
 /****************************************************************************
  * Private Function Prototypes
@@ -68,7 +71,7 @@ static void send_frame(adb_client_t *client, apacket *p)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
+    count = client->skip_checksum ? 0 : p->msg.data_length;
     x = (unsigned char *) p->data;
     sum = 0;
     while(count-- > 0){
@@ -99,7 +102,7 @@ static void send_close_frame(adb_client_t *client, apacket *p,
 static void send_cnxn_frame(adb_client_t *client, apacket *p)
 {
     p->msg.command = A_CNXN;
-    p->msg.arg0 = A_VERSION;
+    p->msg.arg0 = client->skip_checksum ? A_VERSION_SKIP_CHECKSUM : A_VERSION;
     p->msg.arg1 = CONFIG_ADBD_PAYLOAD_SIZE;
     p->msg.data_length = adb_fill_connect_data((char *)p->data,
                                                CONFIG_ADBD_CNXN_PAYLOAD_SIZE);
@@ -159,6 +162,11 @@ static void handle_open_frame(adb_client_t *client, apacket *p) {
         }
         else {
             adb_send_okay_frame_with_data(client, p, svc->id, svc->peer_id);
+
+            /* Service may send data once open is acknowledged */
+            if (svc->ops->on_kick) {
+                svc->ops->on_kick(svc);
+            }
         }
     }
 }
@@ -332,6 +340,32 @@ void adb_send_data_frame(adb_client_t *client, apacket *p)
     send_frame(client, p);
 }
 
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+int adb_send_data_frame_from_fd(adb_client_t *client, apacket *p, int fd)
+{
+    int ret;
+
+    /* Payload is not seen by daemon so it cannot be checksummed */
+
+    if (!client->skip_checksum || client->ops->splice == NULL) {
+        return -EAGAIN;
+    }
+
+    p->msg.command = A_WRTE;
+    p->msg.data_length = p->write_len;
+    p->msg.data_check = 0;
+    p->msg.magic = p->msg.command ^ 0xffffffff;
+
+    ret = client->ops->splice(client, p, fd);
+    if (ret < 0 && ret != -EAGAIN) {
+        adb_err("splice failed %d %d\n", ret, p->msg.data_length);
+        client->ops->close(client);
+    }
+
+    return ret;
+}
+#endif
+
 void adb_register_service(adb_service_t *svc, adb_client_t *client) {
     svc->id = client->next_service_id++;
     svc->next = client->services;
@@ -353,7 +387,7 @@ static adb_service_t *adb_service_open(adb_client_t *client, const char *name, a
     do {
 #ifdef CONFIG_ADBD_FILE_SERVICE
         if(!strncmp(name, "sync:", 5)) {
-            svc = file_sync_service(name);
+            svc = file_sync_service(client, name);
             break;
         }
 #endif
@@ -382,6 +416,26 @@ static adb_service_t *adb_service_open(adb_client_t *client, const char *name, a
         }
 #endif
 
+#ifdef CONFIG_ADBD_SHELL_EXEC
+        if (!strncmp(name, ADB_EXEC_PREFIX, sizeof(ADB_EXEC_PREFIX)-1)) {
+#ifdef CONFIG_ADBD_SHELL_BUILTIN
+            svc = shell_builtin_service(client, name, p);
+            if (svc != NULL) {
+                break;
+            }
+#endif
+            svc = shell_service(client, name);
+            break;
+        }
+#endif
+
+#ifdef CONFIG_ADBD_DEV_SERVICE
+        if (!strncmp(name, ADB_DEV_PREFIX, sizeof(ADB_DEV_PREFIX)-1)) {
+            svc = dev_service(client, name);
+            break;
+        }
+#endif
+
         if (!strncmp(name, "reboot:", 7)) {
             adb_reboot_impl(&name[7]);
 
@@ -401,22 +455,21 @@ static adb_service_t *adb_service_open(adb_client_t *client, const char *name, a
 }
 
 void adb_service_close(adb_client_t *client, adb_service_t *svc, apacket *p) {
-    adb_service_t *cur_svc = client->services;
-
-    if (cur_svc == svc) {
-        client->services = svc->next;
-        goto exit_free_service;
-    }
+    adb_service_t **cur_svc = &client->services;
 
-    while (cur_svc->next) {
-        if (cur_svc->next == svc) {
-            cur_svc->next = svc->next;
+    while (*cur_svc != NULL) {
+        if (*cur_svc == svc) {
+            *cur_svc = svc->next;
             goto exit_free_service;
         }
-        cur_svc = cur_svc->next;
+        cur_svc = &(*cur_svc)->next;
     }
 
     adb_warn("service %p not found\n", svc);
+    if (p) {
+        /* Service already closed, e.g. from a cancelled write */
+        adb_hal_apacket_release(client, p);
+    }
     return;
 
 exit_free_service:
@@ -455,6 +508,7 @@ static void adb_init_client(adb_client_t *client) {
     client->next_service_id = 1;
     client->services = NULL;
     client->is_connected = 0;
+    client->skip_checksum = 0;
 }
 
 adb_client_t *adb_create_client(size_t size) {
@@ -470,6 +524,10 @@ adb_client_t *adb_create_client(size_t size) {
 void adb_destroy_client(adb_client_t *client) {
     adb_service_t *service = client->services;
     adb_service_t *next;
+
+    /* Services may outlive a lost transport */
+    client->is_connected = 0;
+
     while (service != NULL) {
         adb_log("stop service %d <-> %d\n", service->id, service->peer_id);
         // FIXME send close frame ?
@@ -486,6 +544,7 @@ void adb_process_packet(adb_client_t *client, apacket *p)
 
     if (p->msg.command == A_CNXN) {
         /* CONNECT(version, maxdata, "system-id-string") */
+        client->skip_checksum = p->msg.arg0 >= A_VERSION_SKIP_CHECKSUM;
 #ifdef CONFIG_ADBD_AUTHENTICATION
         if (!client->is_connected) {
             send_auth_request(client, p);
@@ -16,6 +16,7 @@
  */
 
 #include <stdarg.h>
+#include <signal.h>
 #include "adb.h"
 
 /****************************************************************************
@@ -43,6 +44,10 @@ int main(int argc, char **argv) {
 
     adb_context_t* ctx;
 
+    /* Writes to closed pipes and sockets are reported as errors */
+
+    signal(SIGPIPE, SIG_IGN);
+
     ctx = adb_hal_create_context();
     if (!ctx) {
         return -1;
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __DEV_SERVICE_H__
+#define __DEV_SERVICE_H__
+
+#include "adb.h"
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+#define ADB_DEV_PREFIX "dev:"
+
+/****************************************************************************
+ * Public Function Prototypes
+ ****************************************************************************/
+
+/* Bridge character device <dev:path[,baud]> to host */
+
+adb_service_t* dev_service(adb_client_t *client, const char *params);
+
+#endif /* __DEV_SERVICE_H__ */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HW_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HW_ARM 1
+#endif
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* CRC32C (Castagnoli), reflected polynomial */
+
+#define CRC32C_POLY 0x82F63B78
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static uint32_t g_crc_table[256];
+static int g_crc_hw = -1;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint32_t crc_update_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len-- > 0) {
+        crc = g_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC_HW_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+    uint64_t crc64 = crc;
+
+    while (len >= sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+
+    crc = crc64;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC_HW_ARM
+static uint32_t crc_update_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    while (len >= sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+
+    while (len-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+    int i;
+    int j;
+    uint32_t crc;
+
+#ifdef CRC_HW_X86
+    g_crc_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC_HW_ARM)
+    g_crc_hw = 1;
+#else
+    g_crc_hw = 0;
+#endif
+
+    if (g_crc_hw) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        g_crc_table[i] = crc;
+    }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+uint32_t afs_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+    if (g_crc_hw < 0) {
+        crc_init();
+    }
+
+    crc = ~crc;
+
+#if defined(CRC_HW_X86) || defined(CRC_HW_ARM)
+    if (g_crc_hw) {
+        return ~crc_update_hw(crc, p, len);
+    }
+#endif
+
+    return ~crc_update_sw(crc, p, len);
+}
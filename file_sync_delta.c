@@ -0,0 +1,571 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* SIGS <block size> <path>
+ *
+ * Replies DATA messages terminated by DONE, like RECV. Content is a
+ * header (file size lo/hi, block size, block count) followed by one
+ * signature per block: rolling checksum, XXH64 lo/hi. Rolling checksum
+ * of bytes x[0..n-1] is a | b << 16 with a = sum(x[i]) and
+ * b = sum((n-i) * x[i]), both modulo 2^16.
+ *
+ * DLTA <block size> <path,mode>
+ *
+ * Followed by DATA messages and DONE, like SEND. Content is a sequence of
+ * operations (type, arg0, arg1):
+ *   COPY     copy arg1 blocks from block arg0 of current file
+ *   LITERAL  arg0 bytes of data follow
+ * File is rebuilt into a temporary file next to target, which replaces
+ * target once DONE is received. */
+
+#define DELTA_OP_COPY    1
+#define DELTA_OP_LITERAL 2
+
+#define DELTA_BLOCK_MIN  64
+#define DELTA_BLOCK_MAX  (1 << 20)
+
+/* Signatures are held in memory while streamed */
+#define DELTA_SIGS_MAX   (4 << 20)
+
+#define DELTA_COPY_SIZE  65536
+
+typedef struct afs_delta_op_s {
+    unsigned type;
+    unsigned arg[2];
+} afs_delta_op_t;
+
+typedef struct afs_delta_s {
+    char *path;
+    uint32_t block_size;
+    int error;
+
+    /* Signatures */
+    uint8_t *sigs;
+    size_t sigs_len;
+    size_t sigs_pos;
+
+    /* Reconstruction */
+    char *tmp_path;
+    int basis_fd;
+    off_t basis_size;
+    int fd;
+    afs_delta_op_t op;
+    unsigned op_len;
+    uint32_t literal;
+    off_t copy_offset;
+    size_t copy_len;
+} afs_delta_t;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static afs_delta_t *delta_create(afs_service_t *svc)
+{
+    uint64_t block_size;
+    afs_delta_t *d;
+
+    if (afs_take_arg64(svc, &block_size) ||
+        block_size < DELTA_BLOCK_MIN || block_size > DELTA_BLOCK_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    d = (afs_delta_t*)calloc(1, sizeof(afs_delta_t));
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->path = strdup(svc->buff);
+    if (d->path == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    d->block_size = block_size;
+    d->basis_fd = -1;
+    d->fd = -1;
+    svc->delta.ctx = d;
+    return d;
+}
+
+static uint32_t delta_rolling_checksum(const uint8_t *buf, size_t len)
+{
+    size_t i;
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    for (i = 0; i < len; i++) {
+        a += buf[i];
+        b += (len - i) * buf[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static void delta_put32(uint8_t *p, uint32_t value)
+{
+    value = htoll(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+/* Called from worker thread */
+
+static void sigs_work(afs_service_t *svc)
+{
+    int fd;
+    ssize_t ret = 0;
+    size_t len;
+    uint8_t *buf;
+    uint8_t *sig;
+    uint64_t hash;
+    uint64_t count;
+    struct stat st;
+    afs_xxh64_t state;
+    afs_delta_t *d = svc->delta.ctx;
+
+    fd = open(d->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        d->error = errno;
+        goto exit_close;
+    }
+
+    count = (st.st_size + d->block_size - 1) / d->block_size;
+    if (16 + count * 12 > DELTA_SIGS_MAX) {
+        d->error = EFBIG;
+        goto exit_close;
+    }
+
+    buf = (uint8_t*)malloc(d->block_size);
+    d->sigs = (uint8_t*)malloc(16 + count * 12);
+    if (buf == NULL || d->sigs == NULL) {
+        free(buf);
+        d->error = ENOMEM;
+        goto exit_close;
+    }
+
+    delta_put32(d->sigs, (uint32_t)st.st_size);
+    delta_put32(d->sigs + 4, (uint32_t)((uint64_t)st.st_size >> 32));
+    delta_put32(d->sigs + 8, d->block_size);
+    delta_put32(d->sigs + 12, count);
+    d->sigs_len = 16;
+
+    sig = d->sigs + 16;
+    while (count-- > 0) {
+        /* Read whole block, last one may be short */
+        len = 0;
+        while (len < d->block_size) {
+            ret = read(fd, buf + len, d->block_size - len);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            len += ret;
+        }
+
+        if (ret < 0) {
+            d->error = errno;
+            break;
+        }
+
+        afs_xxh64_init(&state);
+        afs_xxh64_update(&state, buf, len);
+        hash = afs_xxh64_digest(&state);
+
+        delta_put32(sig, delta_rolling_checksum(buf, len));
+        delta_put32(sig + 4, (uint32_t)hash);
+        delta_put32(sig + 8, (uint32_t)(hash >> 32));
+        sig += 12;
+        d->sigs_len += 12;
+    }
+
+    free(buf);
+
+exit_close:
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void copy_work(afs_service_t *svc)
+{
+    ssize_t ret;
+    uint8_t *buf = NULL;
+    afs_delta_t *d = svc->delta.ctx;
+
+#ifdef __linux__
+    /* Let kernel copy blocks, possibly sharing extents */
+    while (d->copy_len > 0) {
+        ret = copy_file_range(d->basis_fd, &d->copy_offset, d->fd, NULL,
+                              d->copy_len, 0);
+        if (ret <= 0) {
+            break;
+        }
+        d->copy_len -= ret;
+    }
+#endif
+
+    while (d->copy_len > 0) {
+        if (buf == NULL) {
+            buf = (uint8_t*)malloc(DELTA_COPY_SIZE);
+            if (buf == NULL) {
+                d->error = ENOMEM;
+                break;
+            }
+        }
+
+        ret = pread(d->basis_fd, buf, min(d->copy_len, DELTA_COPY_SIZE),
+                    d->copy_offset);
+        if (ret <= 0) {
+            d->error = ret < 0 ? errno : EIO;
+            break;
+        }
+
+        if (write(d->fd, buf, ret) != ret) {
+            d->error = errno ? errno : EIO;
+            break;
+        }
+
+        d->copy_offset += ret;
+        d->copy_len -= ret;
+    }
+
+    free(buf);
+}
+
+static int sigs_work_reply(afs_service_t *svc, apacket *p)
+{
+    afs_delta_t *d = svc->delta.ctx;
+
+    if (d->error) {
+        errno = d->error;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    svc->state = AFS_STATE_PROCESS_SIGS;
+    return afs_state_process_sigs(svc, p);
+}
+
+static int copy_work_reply(afs_service_t *svc, apacket *p)
+{
+    UNUSED(p);
+
+    /* Errors are reported once delta is complete */
+    if (svc->namelen == 0) {
+        svc->state = AFS_STATE_PROCESS_DELTA_HDR;
+    }
+    return 1;
+}
+
+static int delta_apply_op(afs_service_t *svc, afs_delta_t *d)
+{
+    uint64_t offset;
+    uint64_t len;
+
+    switch (ltohl(d->op.type)) {
+        case DELTA_OP_LITERAL:
+            d->literal = ltohl(d->op.arg[0]);
+            return 1;
+
+        case DELTA_OP_COPY:
+            offset = (uint64_t)ltohl(d->op.arg[0]) * d->block_size;
+            len = (uint64_t)ltohl(d->op.arg[1]) * d->block_size;
+
+            if (d->basis_fd < 0 || offset >= (uint64_t)d->basis_size) {
+                d->error = EINVAL;
+                return 1;
+            }
+
+            /* Last block may be short */
+            d->copy_offset = offset;
+            d->copy_len = min(len, (uint64_t)d->basis_size - offset);
+            return afs_queue_work(svc, copy_work, copy_work_reply);
+
+        default:
+            d->error = EINVAL;
+            return 1;
+    }
+}
+
+static int delta_finish(afs_service_t *svc, apacket *p)
+{
+    afs_delta_t *d = svc->delta.ctx;
+
+    if (d->error == 0 && (d->op_len > 0 || d->literal > 0)) {
+        /* Operation incomplete */
+        d->error = EINVAL;
+    }
+
+    if (close(d->fd) && d->error == 0) {
+        d->error = errno;
+    }
+    d->fd = -1;
+
+    if (d->error == 0 && rename(d->tmp_path, d->path)) {
+        d->error = errno;
+    }
+
+    if (d->error) {
+        errno = d->error;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    /* Temporary file is now target */
+    free(d->tmp_path);
+    d->tmp_path = NULL;
+    return afs_prepare_okay_message(svc, p);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_state_init_sigs(afs_service_t *svc, apacket *p)
+{
+    if (delta_create(svc) == NULL) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    /* Set state so context is released on error */
+    svc->state = AFS_STATE_PROCESS_SIGS;
+
+    /* Read file and compute signatures in worker thread */
+    return afs_queue_work(svc, sigs_work, sigs_work_reply);
+}
+
+int afs_state_process_sigs(afs_service_t *svc, apacket *p)
+{
+    unsigned len;
+    union syncmsg *msg;
+    afs_delta_t *d = svc->delta.ctx;
+
+    if (CONFIG_ADBD_PAYLOAD_SIZE - p->write_len <= sizeof(msg->data)) {
+        /* Continue in next frame */
+        return 1;
+    }
+
+    msg = afs_reserve_reply(svc, p, CONFIG_ADBD_PAYLOAD_SIZE - p->write_len);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    if (d->sigs_pos == d->sigs_len) {
+        msg->status.id = ID_DONE;
+        msg->status.msglen = 0;
+        p->write_len += sizeof(msg->status);
+        return 0;
+    }
+
+    len = min(CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len,
+              d->sigs_len - d->sigs_pos);
+    memcpy((&msg->data)+1, d->sigs + d->sigs_pos, len);
+    d->sigs_pos += len;
+
+    msg->data.id = ID_DATA;
+    msg->data.size = htoll(len);
+    p->write_len += sizeof(msg->data) + len;
+    return 1;
+}
+
+int afs_state_init_delta(afs_service_t *svc, apacket *p)
+{
+    int len;
+    mode_t mode = 0644;
+    char *tmp;
+    struct stat st;
+    afs_delta_t *d;
+
+    d = delta_create(svc);
+    if (d == NULL) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+    svc->state = AFS_STATE_PROCESS_DELTA_HDR;
+
+    tmp = strrchr(d->path, ',');
+    if (tmp) {
+        *tmp = 0;
+        mode = strtoul(tmp + 1, NULL, 0) & 0777;
+    }
+
+    /* Blocks are copied from current file */
+    d->basis_fd = open(d->path, O_RDONLY);
+    if (d->basis_fd >= 0 && fstat(d->basis_fd, &st) == 0) {
+        d->basis_size = st.st_size;
+    }
+
+    if (afs_create_path_directories(svc, d->path)) {
+        d->error = errno;
+        return 1;
+    }
+
+    len = strlen(d->path);
+    d->tmp_path = (char*)malloc(len + sizeof(".XXXXXX"));
+    if (d->tmp_path == NULL) {
+        d->error = ENOMEM;
+        return 1;
+    }
+
+    memcpy(d->tmp_path, d->path, len);
+    memcpy(d->tmp_path + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    d->fd = mkstemp(d->tmp_path);
+    if (d->fd < 0 && afs_retry_path_directories(svc, d->path) == 0) {
+        memcpy(d->tmp_path + len, ".XXXXXX", sizeof(".XXXXXX"));
+        d->fd = mkstemp(d->tmp_path);
+    }
+    if (d->fd < 0) {
+        d->error = errno;
+        free(d->tmp_path);
+        d->tmp_path = NULL;
+        return 1;
+    }
+
+    fchmod(d->fd, mode);
+    return 1;
+}
+
+int afs_state_process_delta_header(afs_service_t *svc, apacket *p)
+{
+    int ret;
+    union syncmsg *msg;
+
+    ret = afs_read_from_packet(svc, sizeof(msg->data));
+    if (ret != 0) {
+        if (ret == -EAGAIN) {
+            return 1;
+        }
+        return afs_prepare_fail_message(svc, p, "read error");
+    }
+
+    msg = (union syncmsg*)svc->buff;
+
+    if (msg->data.id == ID_DATA) {
+        svc->namelen = ltohl(msg->data.size);
+        svc->state = AFS_STATE_PROCESS_DELTA_DATA;
+        return 1;
+    }
+
+    if (msg->data.id != ID_DONE) {
+        adb_log("Data message is 0x%x\n", msg->data.id);
+        return afs_prepare_fail_message(svc, p, "invalid data message");
+    }
+
+    return delta_finish(svc, p);
+}
+
+int afs_state_process_delta_data(afs_service_t *svc, apacket *p)
+{
+    int ret = 1;
+    ssize_t written;
+    unsigned len;
+    afs_delta_t *d = svc->delta.ctx;
+
+    UNUSED(p);
+
+    while (svc->namelen > 0 && svc->packet_len > 0 &&
+           ret != AFS_PROCESS_ASYNC) {
+        len = min(svc->packet_len, svc->namelen);
+
+        if (d->literal > 0) {
+            len = min(len, d->literal);
+            if (d->fd >= 0 && d->error == 0) {
+                written = write(d->fd, svc->packet_ptr, len);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    d->error = written < 0 ? errno : EIO;
+                }
+                else {
+                    len = written;
+                }
+            }
+            d->literal -= len;
+        }
+        else {
+            len = min(len, sizeof(d->op) - d->op_len);
+            memcpy((uint8_t*)&d->op + d->op_len, svc->packet_ptr, len);
+            d->op_len += len;
+        }
+
+        svc->namelen -= len;
+        svc->packet_len -= len;
+        svc->packet_ptr += len;
+
+        if (d->op_len == sizeof(d->op)) {
+            d->op_len = 0;
+            if (d->error == 0) {
+                ret = delta_apply_op(svc, d);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            else if (ltohl(d->op.type) == DELTA_OP_LITERAL) {
+                /* Skip literal data */
+                d->literal = ltohl(d->op.arg[0]);
+            }
+        }
+    }
+
+    if (ret != AFS_PROCESS_ASYNC && svc->namelen == 0) {
+        svc->state = AFS_STATE_PROCESS_DELTA_HDR;
+    }
+    return ret;
+}
+
+void afs_delta_reset(afs_service_t *svc)
+{
+    afs_delta_t *d = svc->delta.ctx;
+
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
+
+    if (d->basis_fd >= 0) {
+        close(d->basis_fd);
+    }
+
+    if (d->tmp_path) {
+        /* Transfer not complete */
+        unlink(d->tmp_path);
+        free(d->tmp_path);
+    }
+
+    free(d->sigs);
+    free(d->path);
+    free(d);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ftw.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* COPY <src>\0<dst>  copy regular file, sharing extents if possible
+ * MOVE <src>\0<dst>  rename file or directory
+ * RMRF <path>        remove path recursively
+ *
+ * Operations are done in worker thread and reply OKAY or FAIL. Parent
+ * directories of destination are created as for SEND. COPY destination
+ * is replaced and gets source permissions, even if it already exists. */
+
+#define FILEOP_COPY_SIZE 65536
+
+#define FILEOP_RMRF_FDS  16
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static char *fileop_dest(afs_service_t *svc)
+{
+    return svc->buff + strlen(svc->buff) + 1;
+}
+
+static int copy_data(int src, int dst)
+{
+    ssize_t ret;
+    ssize_t len;
+    uint8_t *buf;
+
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return 0;
+    }
+#endif
+
+#ifdef __linux__
+    /* Let kernel copy data, possibly sharing extents */
+    while ((ret = copy_file_range(src, NULL, dst, NULL, SSIZE_MAX, 0)) > 0);
+    if (ret == 0) {
+        return 0;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+        errno != EOPNOTSUPP) {
+        return -1;
+    }
+#endif
+
+    buf = (uint8_t*)malloc(FILEOP_COPY_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    while ((len = read(src, buf, FILEOP_COPY_SIZE)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (write(dst, buf, len) != len) {
+            len = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    return len == 0 ? 0 : -1;
+}
+
+static int rmrf_entry(const char *path, const struct stat *st, int flag,
+                      struct FTW *ftw)
+{
+    UNUSED(st);
+    UNUSED(ftw);
+
+    if ((flag == FTW_DP ? rmdir(path) : unlink(path)) < 0 &&
+        errno != ENOENT) {
+        adb_err("cannot remove <%s> %d\n", path, errno);
+        return errno;
+    }
+    return 0;
+}
+
+/* Called from worker thread */
+
+static void fileop_work(afs_service_t *svc)
+{
+    int ret;
+    int src;
+    int dst;
+    struct stat st;
+    struct stat dst_st;
+
+    svc->fileop.error = 0;
+
+    switch (svc->cmd) {
+        case ID_COPY:
+            src = open(svc->buff, O_RDONLY | O_CLOEXEC);
+            if (src < 0 || fstat(src, &st)) {
+                break;
+            }
+
+            if (!S_ISREG(st.st_mode)) {
+                errno = EINVAL;
+                close(src);
+                break;
+            }
+
+            /* Destination is truncated before copy */
+            if (!stat(fileop_dest(svc), &dst_st) &&
+                dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+                errno = EINVAL;
+                close(src);
+                break;
+            }
+
+            dst = afs_open_send_file(svc, fileop_dest(svc),
+                                     st.st_mode & 0777, O_TRUNC);
+            if (dst < 0) {
+                close(src);
+                break;
+            }
+
+            ret = copy_data(src, dst);
+            if (close(dst) || ret) {
+                svc->fileop.error = errno ? errno : EIO;
+            }
+            close(src);
+            return;
+
+        case ID_MOVE:
+            if (rename(svc->buff, fileop_dest(svc)) == 0 ||
+                (afs_retry_path_directories(svc, fileop_dest(svc)) == 0 &&
+                 rename(svc->buff, fileop_dest(svc)) == 0)) {
+                return;
+            }
+            break;
+
+        case ID_RMRF:
+            /* Do not follow symlinks, remove content before directories */
+            ret = nftw(svc->buff, rmrf_entry, FILEOP_RMRF_FDS,
+                       FTW_DEPTH | FTW_PHYS);
+            if (ret == 0) {
+                return;
+            }
+            if (ret > 0) {
+                errno = ret;
+            }
+            break;
+    }
+
+    svc->fileop.error = errno ? errno : EIO;
+}
+
+static int fileop_work_reply(afs_service_t *svc, apacket *p)
+{
+    if (svc->fileop.error) {
+        errno = svc->fileop.error;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    return afs_prepare_okay_message(svc, p);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_state_init_fileop(afs_service_t *svc, apacket *p)
+{
+    if (svc->cmd == ID_RMRF) {
+        if (svc->buff[0] == 0 || !strcmp(svc->buff, "/")) {
+            return afs_prepare_fail_message(svc, p, "invalid path");
+        }
+    }
+    else {
+        /* Destination follows source */
+        if (strlen(svc->buff) + 1 >= svc->namelen) {
+            return afs_prepare_fail_message(svc, p, "missing destination");
+        }
+
+        if (afs_create_path_directories(svc, fileop_dest(svc))) {
+            return afs_prepare_fail_errno(svc, p);
+        }
+    }
+
+    return afs_queue_work(svc, fileop_work, fileop_work_reply);
+}
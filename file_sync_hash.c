@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define HASH_READ_SIZE 4096
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Hashes of recently hashed files, shared by all sessions.
+ * Only accessed from adb thread. */
+
+static afs_hash_entry_t g_hash_cache[CONFIG_ADBD_FILE_HASH_CACHE];
+static unsigned g_hash_cache_next;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little endian host assumed, as for sync protocol messages */
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void hash_entry_from_stat(afs_hash_entry_t *entry, struct stat *st)
+{
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int hash_entry_match(afs_hash_entry_t *a, afs_hash_entry_t *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec;
+}
+
+static afs_hash_entry_t *hash_cache_lookup(afs_hash_entry_t *entry)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_ADBD_FILE_HASH_CACHE; i++) {
+        if (g_hash_cache[i].ino != 0 &&
+            hash_entry_match(&g_hash_cache[i], entry)) {
+            return &g_hash_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void hash_cache_insert(afs_hash_entry_t *entry)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_ADBD_FILE_HASH_CACHE; i++) {
+        if (g_hash_cache[i].dev == entry->dev &&
+            g_hash_cache[i].ino == entry->ino) {
+            /* Replace outdated hash of same file */
+            g_hash_cache[i] = *entry;
+            return;
+        }
+    }
+
+    g_hash_cache[g_hash_cache_next] = *entry;
+    g_hash_cache_next = (g_hash_cache_next + 1) % CONFIG_ADBD_FILE_HASH_CACHE;
+}
+
+static int prepare_hash_message(afs_service_t *svc, apacket *p,
+                                afs_hash_entry_t *entry)
+{
+    union syncmsg *msg = afs_reserve_reply(svc, p, sizeof(msg->hash));
+
+    if (msg == NULL) {
+        return -1;
+    }
+
+    msg->hash.id = ID_HASH;
+    msg->hash.size[0] = htoll((uint32_t)entry->size);
+    msg->hash.size[1] = htoll((uint32_t)((uint64_t)entry->size >> 32));
+    msg->hash.hash[0] = htoll((uint32_t)entry->hash);
+    msg->hash.hash[1] = htoll((uint32_t)(entry->hash >> 32));
+    p->write_len += sizeof(msg->hash);
+    return 0;
+}
+
+/* Called from worker thread */
+
+static void hash_work(afs_service_t *svc)
+{
+    int fd;
+    ssize_t ret;
+    uint8_t *buf;
+    struct stat st;
+    afs_xxh64_t state;
+
+    svc->hash.error = 0;
+
+    buf = (uint8_t*)malloc(HASH_READ_SIZE);
+    if (buf == NULL) {
+        svc->hash.error = ENOMEM;
+        return;
+    }
+
+    fd = open(svc->buff, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        svc->hash.error = errno;
+        goto exit_free;
+    }
+
+    if (fstat(fd, &st)) {
+        svc->hash.error = errno;
+        goto exit_close;
+    }
+
+    hash_entry_from_stat(&svc->hash.entry, &st);
+    afs_xxh64_init(&state);
+
+    while ((ret = read(fd, buf, HASH_READ_SIZE)) != 0) {
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            svc->hash.error = errno;
+            goto exit_close;
+        }
+        afs_xxh64_update(&state, buf, ret);
+    }
+
+    svc->hash.entry.hash = afs_xxh64_digest(&state);
+
+    /* Only cache hash if file has not been modified while hashing */
+    if (fstat(fd, &st) == 0 && state.total_len == (uint64_t)st.st_size) {
+        afs_hash_entry_t after;
+        hash_entry_from_stat(&after, &st);
+        if (hash_entry_match(&after, &svc->hash.entry)) {
+            goto exit_close;
+        }
+    }
+
+    /* Report hash of content read but do not cache it */
+    svc->hash.entry.size = state.total_len;
+    svc->hash.entry.ino = 0;
+
+exit_close:
+    if (fd >= 0) {
+        close(fd);
+    }
+exit_free:
+    free(buf);
+}
+
+static int hash_work_reply(afs_service_t *svc, apacket *p)
+{
+    if (svc->hash.error) {
+        errno = svc->hash.error;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    if (svc->hash.entry.ino != 0) {
+        hash_cache_insert(&svc->hash.entry);
+    }
+
+    return prepare_hash_message(svc, p, &svc->hash.entry);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void afs_xxh64_init(afs_xxh64_t *state)
+{
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+    state->total_len = 0;
+    state->memsize = 0;
+}
+
+static void xxh64_stripe(afs_xxh64_t *state, const uint8_t *p)
+{
+    state->v[0] = xxh_round(state->v[0], xxh_read64(p));
+    state->v[1] = xxh_round(state->v[1], xxh_read64(p+8));
+    state->v[2] = xxh_round(state->v[2], xxh_read64(p+16));
+    state->v[3] = xxh_round(state->v[3], xxh_read64(p+24));
+}
+
+void afs_xxh64_update(afs_xxh64_t *state, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+
+    state->total_len += len;
+
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+
+    if (state->memsize > 0) {
+        /* Complete stripe left from previous update */
+        memcpy(state->mem + state->memsize, p, 32 - state->memsize);
+        p += 32 - state->memsize;
+        xxh64_stripe(state, state->mem);
+        state->memsize = 0;
+    }
+
+    while (p + 32 <= end) {
+        xxh64_stripe(state, p);
+        p += 32;
+    }
+
+    state->memsize = end - p;
+    memcpy(state->mem, p, state->memsize);
+}
+
+uint64_t afs_xxh64_digest(afs_xxh64_t *state)
+{
+    uint64_t h;
+    const uint8_t *p = state->mem;
+    const uint8_t *end = p + state->memsize;
+
+    if (state->total_len >= 32) {
+        h = xxh_rotl64(state->v[0], 1) + xxh_rotl64(state->v[1], 7) +
+            xxh_rotl64(state->v[2], 12) + xxh_rotl64(state->v[3], 18);
+        h = xxh_merge_round(h, state->v[0]);
+        h = xxh_merge_round(h, state->v[1]);
+        h = xxh_merge_round(h, state->v[2]);
+        h = xxh_merge_round(h, state->v[3]);
+    }
+    else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+
+    h += state->total_len;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+int afs_state_init_hash(afs_service_t *svc, apacket *p)
+{
+    struct stat st;
+    afs_hash_entry_t entry;
+    afs_hash_entry_t *cached;
+
+    if (stat(svc->buff, &st)) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        return afs_prepare_fail_message(svc, p, "not a regular file");
+    }
+
+    hash_entry_from_stat(&entry, &st);
+    cached = hash_cache_lookup(&entry);
+    if (cached != NULL) {
+        return prepare_hash_message(svc, p, cached);
+    }
+
+    /* Read file content from worker thread */
+    return afs_queue_work(svc, hash_work, hash_work_reply);
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _FILE_SYNC_PRIV_H_
+#define _FILE_SYNC_PRIV_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <dirent.h>
+#include <sys/types.h>
+
+#include "adb.h"
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+#define htoll(x) (x)
+#define ltohl(x) (x)
+
+#define MKID(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+
+#define ID_STAT MKID('S','T','A','T')
+#define ID_LIST MKID('L','I','S','T')
+#define ID_ULNK MKID('U','L','N','K')
+#define ID_SEND MKID('S','E','N','D')
+#define ID_RECV MKID('R','E','C','V')
+#define ID_DENT MKID('D','E','N','T')
+#define ID_DONE MKID('D','O','N','E')
+#define ID_DATA MKID('D','A','T','A')
+#define ID_OKAY MKID('O','K','A','Y')
+#define ID_FAIL MKID('F','A','I','L')
+#define ID_QUIT MKID('Q','U','I','T')
+
+/* Extensions */
+
+#define ID_HASH MKID('H','A','S','H')
+#define ID_SNDH MKID('S','N','D','H')
+#define ID_MISS MKID('M','I','S','S')
+#define ID_RCVR MKID('R','C','V','R')
+#define ID_SNDO MKID('S','N','D','O')
+#define ID_TRCV MKID('T','R','C','V')
+#define ID_TSND MKID('T','S','N','D')
+#define ID_SIGS MKID('S','I','G','S')
+#define ID_DLTA MKID('D','L','T','A')
+#define ID_RCVS MKID('R','C','V','S')
+#define ID_HOLE MKID('H','O','L','E')
+#define ID_SPRS MKID('S','P','R','S')
+#define ID_WALK MKID('W','A','L','K')
+#define ID_WENT MKID('W','E','N','T')
+#define ID_COPY MKID('C','O','P','Y')
+#define ID_MOVE MKID('M','O','V','E')
+#define ID_RMRF MKID('R','M','R','F')
+#define ID_CSUM MKID('C','S','U','M')
+
+/* SNDO offset to append data at end of file */
+#define SYNC_OFFSET_APPEND (-1)
+
+/* Largest hole reported by a single HOLE message */
+#define SYNC_HOLE_MAX (1 << 30)
+
+#define min(a,b) ((a) < (b) ? (a):(b))
+
+#define SYNC_TEMP_BUFF_SIZE PATH_MAX
+
+/* Requests up to this size are reassembled in service, larger ones in
+ * a buffer allocated until request is processed */
+#define SYNC_BUFF_INLINE_SIZE 64
+
+/* Room required in reply frame before processing next request */
+#define SYNC_REPLY_MIN sizeof(union syncmsg)
+
+/* State functions return code when request is processed by worker thread */
+#define AFS_PROCESS_ASYNC 2
+
+union syncmsg {
+    unsigned id;
+    struct {
+        unsigned id;
+        unsigned namelen;
+    } req;
+    struct {
+        unsigned id;
+        unsigned mode;
+        unsigned size;
+        unsigned time;
+    } stat;
+    struct {
+        unsigned id;
+        unsigned mode;
+        unsigned size;
+        unsigned time;
+        unsigned namelen;
+    } dent;
+    struct {
+        unsigned id;
+        unsigned size;
+    } data;
+    struct {
+        unsigned id;
+        unsigned msglen;
+    } status;
+    struct {
+        unsigned id;
+        unsigned size[2];
+        unsigned hash[2];
+    } hash;
+    struct {
+        unsigned id;
+        unsigned skipped[2];
+    } sparse;
+};
+
+enum {
+    AFS_STATE_WAIT_CMD,
+    AFS_STATE_WAIT_CMD_DATA,
+    AFS_STATE_PROCESS_RECV,
+    AFS_STATE_PROCESS_LIST,
+    AFS_STATE_PROCESS_SEND_FILE_HDR,
+    AFS_STATE_PROCESS_SEND_FILE_DATA,
+    AFS_STATE_PROCESS_SEND_SYM_HDR,
+    AFS_STATE_PROCESS_SEND_SYM_DATA,
+    AFS_STATE_WAIT_WORK,
+    AFS_STATE_PROCESS_TREE_RECV,
+    AFS_STATE_PROCESS_TREE_SEND_HDR,
+    AFS_STATE_PROCESS_TREE_SEND_DATA,
+    AFS_STATE_PROCESS_SIGS,
+    AFS_STATE_PROCESS_DELTA_HDR,
+    AFS_STATE_PROCESS_DELTA_DATA,
+    AFS_STATE_PROCESS_WALK
+};
+
+#ifdef CONFIG_ADBD_FILE_HASH
+typedef struct afs_xxh64_s {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    unsigned memsize;
+} afs_xxh64_t;
+
+typedef struct afs_hash_entry_s {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    uint64_t hash;
+} afs_hash_entry_t;
+#endif
+
+typedef struct afs_service_s {
+    adb_service_t service;
+    adb_client_t *client;
+
+    /* Requests left to process */
+    uint8_t *packet_ptr;
+    unsigned packet_len;
+
+    /* Requests kept aside while replies are being sent */
+    uint8_t *pending;
+
+    /* Host frame is acknowledged once all its requests are processed */
+    uint8_t delayed_ack;
+
+    /* Request processed by worker thread */
+    apacket *work_packet;
+    uint8_t work_state;
+    void (*work_cb)(struct afs_service_s *svc);
+    int (*work_reply_cb)(struct afs_service_s *svc, apacket *p);
+
+#ifdef CONFIG_ADBD_FILE_STORE
+    /* Content hash offered by host for next SEND request */
+    uint64_t store_hash;
+    uint8_t store_offer;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    /* Zero blocks of pushed files are skipped when enabled by host */
+    uint64_t skipped_bytes;
+    uint8_t skip_zeros;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+    /* File content CRC32C is exchanged before DONE when enabled */
+    uint8_t crc_enabled;
+#endif
+
+    uint8_t state;
+    unsigned cmd;
+    unsigned namelen;
+
+    union {
+        struct {
+            DIR *d;
+            char *path;
+            char *file_ptr;
+        } list;
+
+        struct {
+            int fd;
+#ifdef CONFIG_ADBD_FILE_STORE
+            char *store_path;
+            afs_xxh64_t store_xxh;
+#endif
+#ifdef CONFIG_ADBD_FILE_SPARSE
+            /* Write offset, block size is 0 if zeros are not skipped */
+            off_t pos;
+            unsigned blksize;
+            uint8_t zero_tail;
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+            /* Destination, removed if content checksum mismatches */
+            char *path;
+            uint32_t crc;
+            uint32_t host_crc;
+            uint8_t host_crc_set;
+#endif
+        } send_file;
+
+        struct {
+            char *path;
+        } send_link;
+
+        struct {
+            int fd;
+            off_t offset;
+            uint64_t remaining;
+#ifdef CONFIG_ADBD_FILE_SPARSE
+            /* End of data region at offset, for sparse transfers */
+            off_t data_end;
+            uint8_t sparse;
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+            uint32_t crc;
+#endif
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+            /* Content read by worker threads, NULL if read in place */
+            struct afs_readahead_s *ra;
+#endif
+        } recv;
+
+#ifdef CONFIG_ADBD_FILE_TREE
+        struct {
+            struct afs_tree_s *ctx;
+        } tree;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_DELTA
+        struct {
+            struct afs_delta_s *ctx;
+        } delta;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_WALK
+        struct {
+            struct afs_walk_s *ctx;
+        } walk;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_HASH
+        struct {
+            int error;
+            afs_hash_entry_t entry;
+        } hash;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_OPS
+        struct {
+            int error;
+        } fileop;
+#endif
+    };
+
+    /* Request data, either read in place from frame (buff_size is 0) or
+     * reassembled in service or allocated buffer */
+    unsigned size;
+    char *buff;
+    unsigned buff_size;
+    char buff_inline[SYNC_BUFF_INLINE_SIZE];
+
+    /* Length of request data read in place, and frame byte replaced by
+     * null terminator of string data */
+    unsigned frame_len;
+    char *frame_term;
+    char frame_term_c;
+
+#ifdef CONFIG_ADBD_FILE_DIR_CACHE
+    /* Directories known to exist, most recently used first */
+    char *dir_cache[CONFIG_ADBD_FILE_DIR_CACHE];
+#endif
+} afs_service_t;
+
+/****************************************************************************
+ * Public Function Prototypes
+ ****************************************************************************/
+
+/* Requests */
+
+/* Accumulate size bytes of request in svc->buff, -EAGAIN until complete.
+ * Data is read in place if not split across frames and is only valid
+ * until next read. */
+int afs_read_from_packet(afs_service_t *svc, unsigned int size);
+
+/* Remove 64 bits little endian argument from start of request data */
+int afs_take_arg64(afs_service_t *svc, uint64_t *value);
+
+/* Files */
+
+int afs_create_path_directories(afs_service_t *svc, char *name);
+
+/* Create path again after an operation on it failed with ENOENT, returns
+ * 0 if the operation is worth retrying as cached directories were
+ * dropped */
+int afs_retry_path_directories(afs_service_t *svc, char *name);
+
+int afs_open_send_file(afs_service_t *svc, char *path, mode_t mode,
+                       int flags);
+
+/* Replies */
+
+unsigned int afs_reply_room(afs_service_t *svc, apacket *p);
+union syncmsg *afs_reserve_reply(afs_service_t *svc, apacket *p,
+                                unsigned int size);
+
+int afs_prepare_fail_message(afs_service_t *svc, apacket *p,
+                             const char *reason);
+int afs_prepare_fail_errno(afs_service_t *svc, apacket *p);
+int afs_prepare_okay_message(afs_service_t *svc, apacket *p);
+
+/* Process request in worker thread. work_cb is called from worker thread
+ * and work_reply_cb from adb thread once work is done to prepare reply.
+ * Service state is restored before work_reply_cb is called, its return
+ * value is handled like the one of a state function. */
+
+int afs_queue_work(afs_service_t *svc,
+                   void (*work_cb)(afs_service_t *svc),
+                   int (*work_reply_cb)(afs_service_t *svc, apacket *p));
+
+/* Continue reply stream with acknowledge frame kept aside */
+
+void afs_resume_stream(afs_service_t *svc, apacket *p);
+
+/* Extensions */
+
+#ifdef CONFIG_ADBD_FILE_HASH
+void afs_xxh64_init(afs_xxh64_t *state);
+void afs_xxh64_update(afs_xxh64_t *state, const uint8_t *p, size_t len);
+uint64_t afs_xxh64_digest(afs_xxh64_t *state);
+
+int afs_state_init_hash(afs_service_t *svc, apacket *p);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_TREE
+int afs_state_init_tree_recv(afs_service_t *svc, apacket *p);
+int afs_state_process_tree_recv(afs_service_t *svc, apacket *p);
+int afs_state_init_tree_send(afs_service_t *svc, apacket *p);
+int afs_state_process_tree_send_header(afs_service_t *svc, apacket *p);
+int afs_state_process_tree_send_data(afs_service_t *svc, apacket *p);
+void afs_tree_reset(afs_service_t *svc);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_DELTA
+int afs_state_init_sigs(afs_service_t *svc, apacket *p);
+int afs_state_process_sigs(afs_service_t *svc, apacket *p);
+int afs_state_init_delta(afs_service_t *svc, apacket *p);
+int afs_state_process_delta_header(afs_service_t *svc, apacket *p);
+int afs_state_process_delta_data(afs_service_t *svc, apacket *p);
+void afs_delta_reset(afs_service_t *svc);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_WALK
+int afs_state_init_walk(afs_service_t *svc, apacket *p);
+int afs_state_process_walk(afs_service_t *svc, apacket *p);
+void afs_walk_reset(afs_service_t *svc);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_OPS
+int afs_state_init_fileop(afs_service_t *svc, apacket *p);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+/* Read RECV content from worker threads, -1 if file is read in place */
+int afs_readahead_start(afs_service_t *svc);
+/* Same as pread at current offset, fails with EAGAIN until data is read */
+ssize_t afs_readahead_read(afs_service_t *svc, void *buf, size_t size);
+/* Keep acknowledge frame until data is read */
+int afs_readahead_wait(afs_service_t *svc, apacket *p);
+void afs_readahead_reset(afs_service_t *svc);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+/* CRC32C of data following crc, initial crc is 0 */
+uint32_t afs_crc32c(uint32_t crc, const uint8_t *p, size_t len);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_STORE
+int afs_store_place(afs_service_t *svc, apacket *p, bool is_link,
+                    mode_t mode);
+void afs_store_begin(afs_service_t *svc);
+void afs_store_commit(afs_service_t *svc);
+#endif
+
+#endif /* _FILE_SYNC_PRIV_H_ */
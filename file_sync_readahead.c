@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* File content of a RECV transfer is read ahead by worker threads in a
+ * ring of chunks, so reads of several transfers run concurrently.
+ * Chunks are consumed in order as frames are acknowledged. Transfer ends
+ * after first short read. */
+
+#define RA_CHUNK_IDLE  0
+#define RA_CHUNK_BUSY  1
+#define RA_CHUNK_READY 2
+
+typedef struct afs_ra_chunk_s {
+    struct afs_readahead_s *ra;
+    off_t offset;
+    unsigned size;
+    ssize_t len;
+    int error;
+    unsigned pos;
+    uint8_t state;
+    uint8_t *data;
+} afs_ra_chunk_t;
+
+typedef struct afs_readahead_s {
+    /* NULL once transfer is over and reads are still in progress */
+    afs_service_t *svc;
+    int fd;
+
+    /* Next read to queue */
+    off_t next;
+    uint64_t left;
+    uint8_t eof;
+
+    /* Chunks queued from head */
+    unsigned head;
+    unsigned queued;
+    unsigned busy;
+
+    /* Acknowledge frame kept until head chunk is read */
+    apacket *packet;
+
+    afs_ra_chunk_t chunks[CONFIG_ADBD_FILE_READAHEAD_CHUNKS];
+} afs_readahead_t;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void ra_free(afs_readahead_t *ra)
+{
+    close(ra->fd);
+    free(ra);
+}
+
+/* Called from worker thread */
+
+static void ra_work(void *arg)
+{
+    afs_ra_chunk_t *c = (afs_ra_chunk_t*)arg;
+
+    do {
+        c->len = pread(c->ra->fd, c->data, c->size, c->offset);
+    } while (c->len < 0 && errno == EINTR);
+
+    c->error = errno;
+}
+
+static void ra_after_work(void *arg)
+{
+    afs_ra_chunk_t *c = (afs_ra_chunk_t*)arg;
+    afs_readahead_t *ra = c->ra;
+    apacket *p = ra->packet;
+
+    c->state = RA_CHUNK_READY;
+    ra->busy -= 1;
+
+    if (ra->svc == NULL) {
+        if (ra->busy == 0) {
+            ra_free(ra);
+        }
+        return;
+    }
+
+    if (p != NULL && c == &ra->chunks[ra->head]) {
+        /* Transfer was waiting for this chunk */
+        ra->packet = NULL;
+        afs_resume_stream(ra->svc, p);
+    }
+}
+
+static void ra_fill(afs_readahead_t *ra)
+{
+    afs_ra_chunk_t *c;
+
+    while (ra->queued < CONFIG_ADBD_FILE_READAHEAD_CHUNKS &&
+           ra->left > 0 && !ra->eof) {
+        c = &ra->chunks[(ra->head + ra->queued) %
+                        CONFIG_ADBD_FILE_READAHEAD_CHUNKS];
+
+        c->offset = ra->next;
+        c->size = min(CONFIG_ADBD_FILE_READAHEAD_SIZE, ra->left);
+        c->pos = 0;
+        c->state = RA_CHUNK_BUSY;
+
+        if (adb_hal_queue_work(ra->svc->client, ra_work,
+                               ra_after_work, c)) {
+            /* Reported once chunk is consumed */
+            c->len = -1;
+            c->error = ENOMEM;
+            c->state = RA_CHUNK_READY;
+        }
+        else {
+            ra->busy += 1;
+        }
+
+        ra->next += c->size;
+        ra->left -= c->size;
+        ra->queued += 1;
+    }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_readahead_start(afs_service_t *svc)
+{
+    int i;
+    struct stat st;
+    afs_readahead_t *ra;
+    uint8_t *data;
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    if (svc->recv.sparse) {
+        /* Holes are looked up in place */
+        return -1;
+    }
+#endif
+
+    /* Not worth it if file is already sent */
+    if (fstat(svc->recv.fd, &st) || !S_ISREG(st.st_mode) ||
+        st.st_size <= svc->recv.offset) {
+        return -1;
+    }
+
+    ra = (afs_readahead_t*)malloc(sizeof(afs_readahead_t) +
+        CONFIG_ADBD_FILE_READAHEAD_CHUNKS * CONFIG_ADBD_FILE_READAHEAD_SIZE);
+    if (ra == NULL) {
+        return -1;
+    }
+
+    data = (uint8_t*)(ra + 1);
+    for (i = 0; i < CONFIG_ADBD_FILE_READAHEAD_CHUNKS; i++) {
+        ra->chunks[i].ra = ra;
+        ra->chunks[i].state = RA_CHUNK_IDLE;
+        ra->chunks[i].data = data + i * CONFIG_ADBD_FILE_READAHEAD_SIZE;
+    }
+
+    ra->svc = svc;
+    ra->fd = svc->recv.fd;
+    ra->next = svc->recv.offset;
+    ra->left = svc->recv.remaining;
+    ra->eof = 0;
+    ra->head = 0;
+    ra->queued = 0;
+    ra->busy = 0;
+    ra->packet = NULL;
+
+    svc->recv.ra = ra;
+    ra_fill(ra);
+    return 0;
+}
+
+ssize_t afs_readahead_read(afs_service_t *svc, void *buf, size_t size)
+{
+    ssize_t len;
+    afs_readahead_t *ra = svc->recv.ra;
+    afs_ra_chunk_t *c = &ra->chunks[ra->head];
+
+    if (size == 0 || ra->queued == 0) {
+        return 0;
+    }
+
+    if (c->state != RA_CHUNK_READY) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (c->len <= 0) {
+        errno = c->error;
+        return c->len;
+    }
+
+    len = min(size, (size_t)(c->len - c->pos));
+    memcpy(buf, c->data + c->pos, len);
+    c->pos += len;
+
+    if (c->pos == c->len) {
+        if (c->len < c->size) {
+            /* Chunks queued after are not contiguous */
+            ra->eof = 1;
+        }
+
+        c->state = RA_CHUNK_IDLE;
+        ra->head = (ra->head + 1) % CONFIG_ADBD_FILE_READAHEAD_CHUNKS;
+        ra->queued -= 1;
+
+        if (ra->eof) {
+            ra->queued = 0;
+        }
+        ra_fill(ra);
+    }
+
+    return len;
+}
+
+int afs_readahead_wait(afs_service_t *svc, apacket *p)
+{
+    svc->recv.ra->packet = p;
+    return AFS_PROCESS_ASYNC;
+}
+
+void afs_readahead_reset(afs_service_t *svc)
+{
+    afs_readahead_t *ra = svc->recv.ra;
+
+    if (ra->packet != NULL) {
+        adb_hal_apacket_release(svc->client, ra->packet);
+    }
+
+    svc->recv.ra = NULL;
+
+    if (ra->busy > 0) {
+        /* Released once reads in progress are done */
+        ra->svc = NULL;
+        return;
+    }
+
+    ra_free(ra);
+}
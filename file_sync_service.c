@@ -15,6 +15,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +26,7 @@
 
 #include "adb.h"
 #include "file_sync_service.h"
+#include "file_sync_priv.h"
 
 #include <dirent.h>
 #include <sys/stat.h>
@@ -31,115 +34,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#define htoll(x) (x)
-#define ltohl(x) (x)
-
-#define MKID(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
-
-#define ID_STAT MKID('S','T','A','T')
-#define ID_LIST MKID('L','I','S','T')
-#define ID_ULNK MKID('U','L','N','K')
-#define ID_SEND MKID('S','E','N','D')
-#define ID_RECV MKID('R','E','C','V')
-#define ID_DENT MKID('D','E','N','T')
-#define ID_DONE MKID('D','O','N','E')
-#define ID_DATA MKID('D','A','T','A')
-#define ID_OKAY MKID('O','K','A','Y')
-#define ID_FAIL MKID('F','A','I','L')
-#define ID_QUIT MKID('Q','U','I','T')
-
-#define min(a,b) ((a) < (b) ? (a):(b))
-
-#define SYNC_TEMP_BUFF_SIZE PATH_MAX
-
 /****************************************************************************
- * Private types
+ * Private Function Prototypes
  ****************************************************************************/
 
-union syncmsg {
-    unsigned id;
-    struct {
-        unsigned id;
-        unsigned namelen;
-    } req;
-    struct {
-        unsigned id;
-        unsigned mode;
-        unsigned size;
-        unsigned time;
-    } stat;
-    struct {
-        unsigned id;
-        unsigned mode;
-        unsigned size;
-        unsigned time;
-        unsigned namelen;
-    } dent;
-    struct {
-        unsigned id;
-        unsigned size;
-    } data;
-    struct {
-        unsigned id;
-        unsigned msglen;
-    } status;
-};
-
-enum {
-    AFS_STATE_WAIT_CMD,
-    AFS_STATE_WAIT_CMD_DATA,
-    AFS_STATE_PROCESS_RECV,
-    AFS_STATE_PROCESS_LIST,
-    AFS_STATE_PROCESS_SEND_FILE_HDR,
-    AFS_STATE_PROCESS_SEND_FILE_DATA,
-    AFS_STATE_PROCESS_SEND_SYM_HDR,
-    AFS_STATE_PROCESS_SEND_SYM_DATA
-};
-
-typedef struct afs_service_s {
-    adb_service_t service;
-    uint8_t *packet_ptr;
-
-    uint8_t state;
-    unsigned cmd;
-    unsigned namelen;
-
-    union {
-        struct {
-            DIR *d;
-            char *path;
-            char *file_ptr;
-        } list;
-
-        struct {
-            int fd;
-        } send_file;
-
-        struct {
-            char *path;
-        } send_link;
-
-        struct {
-            int fd;
-        } recv;
-    };
+/* Helpers */
 
-    unsigned size;
-    char buff[SYNC_TEMP_BUFF_SIZE];
-} afs_service_t;
 
-/****************************************************************************
- * Private Function Prototypes
- ****************************************************************************/
+/* Directory cache */
 
-/* Helpers */
+static int dir_cache_lookup(afs_service_t *svc, const char *name);
+static void dir_cache_insert(afs_service_t *svc, const char *name, int len);
+static int dir_cache_flush(afs_service_t *svc);
 
-static int read_from_packet(afs_service_t *svc, apacket *p, unsigned int size);
-static int create_path_directories(char *name);
+static int stash_requests(afs_service_t *svc);
 
-static void prepare_fail_message(afs_service_t *svc, apacket *p, const char *reason);
-static void prepare_fail_errno(afs_service_t *svc, apacket *p);
-static void prepare_okay_message(afs_service_t *svc, apacket *p);
 
 /* Generic states for file service */
 
@@ -151,9 +60,18 @@ static int state_wait_cmd_data(afs_service_t *svc, apacket *p);
 static int state_init_stat(afs_service_t *svc, apacket *p);
 static int state_init_list(afs_service_t *svc, apacket *p);
 static int state_init_send(afs_service_t *svc, apacket *p);
-static int state_init_send_file(afs_service_t *svc, apacket *p, mode_t mode);
+static int state_init_send_file(afs_service_t *svc, apacket *p, mode_t mode,
+                                int64_t offset);
 static int state_init_send_link(afs_service_t *svc, apacket *p);
 static int state_init_recv(afs_service_t *svc, apacket *p);
+static int state_init_unlink(afs_service_t *svc, apacket *p);
+#ifdef CONFIG_ADBD_FILE_SPARSE
+static int state_init_sparse(afs_service_t *svc, apacket *p);
+static void send_file_init_sparse(afs_service_t *svc, off_t offset);
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+static int state_init_checksum(afs_service_t *svc, apacket *p);
+#endif
 
 /* State process functions */
 
@@ -168,6 +86,15 @@ static int state_process_list(afs_service_t *svc, apacket *p);
 /* Reset service state */
 
 static void state_reset(afs_service_t *svc);
+static void buff_release(afs_service_t *svc);
+static int buff_detach(afs_service_t *svc);
+
+/* Request processing */
+
+static bool reply_stream_active(afs_service_t *svc);
+static int process_requests(afs_service_t *svc, apacket *p);
+static int resume_requests(afs_service_t *svc, apacket *p);
+static int send_replies_and_ack(afs_service_t *svc, apacket *p);
 
 /* Frame processing */
 
@@ -175,44 +102,98 @@ static int file_sync_on_ack(adb_service_t *service, apacket *p);
 static int file_sync_on_write(adb_service_t *service, apacket *p);
 static void file_sync_on_close(struct adb_service_s *service);
 
+/* Worker thread */
+
+static void file_sync_work(void *arg);
+static void file_sync_after_work(void *arg);
+static void file_sync_release(afs_service_t *svc);
+
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
 
-static void prepare_fail_message(afs_service_t *svc, apacket *p, const char *reason)
+static int stash_requests(afs_service_t *svc)
 {
-    UNUSED(svc);
-    int len;
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    uint8_t *pending;
 
-    adb_err("sync: failure: %s\n", reason);
+    /* Frame is about to be overwritten by replies */
+    if (buff_detach(svc)) {
+        return -ENOMEM;
+    }
 
-    len = min(strlen(reason),
-        CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len);
-    memcpy((char*)(&msg->data+1), reason, len);
+    pending = (uint8_t*)malloc(svc->packet_len);
 
-    msg->data.id = ID_FAIL;
-    msg->data.size = htoll(len);
+    if (pending == NULL) {
+        adb_err("Cannot allocate pending requests\n");
+        return -ENOMEM;
+    }
 
-    p->write_len += sizeof(msg->data) + len;
+    memcpy(pending, svc->packet_ptr, svc->packet_len);
+    svc->pending = pending;
+    svc->packet_ptr = pending;
+    return 0;
 }
 
-static void prepare_fail_errno(afs_service_t *svc, apacket *p)
+static int buff_reserve(afs_service_t *svc, unsigned size)
 {
-    prepare_fail_message(svc, p, strerror(errno));
+    char *buff;
+
+    if (size <= svc->buff_size) {
+        return 0;
+    }
+
+    buff = (char*)malloc(size);
+    if (buff == NULL) {
+        adb_err("Cannot allocate request buffer\n");
+        return -1;
+    }
+
+    memcpy(buff, svc->buff, svc->size);
+    buff_release(svc);
+    svc->buff = buff;
+    svc->buff_size = size;
+    return 0;
 }
 
-static void prepare_okay_message(afs_service_t *svc, apacket *p)
+static void buff_release(afs_service_t *svc)
 {
-    UNUSED(svc);
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    if (svc->buff_size == 0) {
+        /* Restore first byte of message following string */
+        if (svc->frame_term != NULL) {
+            *svc->frame_term = svc->frame_term_c;
+            svc->frame_term = NULL;
+        }
+    }
+    else if (svc->buff != svc->buff_inline) {
+        free(svc->buff);
+    }
 
-    msg->status.id = ID_OKAY;
-    msg->status.msglen = 0;
-    p->write_len += sizeof(msg->status);
+    svc->buff = svc->buff_inline;
+    svc->buff_size = sizeof(svc->buff_inline);
+}
+
+static int buff_detach(afs_service_t *svc)
+{
+    char *data = svc->buff;
+    unsigned len = svc->frame_len;
+
+    if (svc->buff_size != 0) {
+        return 0;
+    }
+
+    /* Copy request data out of frame before frame is reused */
+    buff_release(svc);
+    if (buff_reserve(svc, len + 1)) {
+        return -1;
+    }
+
+    memcpy(svc->buff, data, len);
+    svc->buff[len] = 0;
+    return 0;
 }
 
-static int read_from_packet(afs_service_t *svc, apacket *p, unsigned int size)
+static int read_from_packet(afs_service_t *svc, unsigned int size,
+                            int string)
 {
     int ret = -EINVAL;
 
@@ -220,15 +201,46 @@ static int read_from_packet(afs_service_t *svc, apacket *p, unsigned int size)
         goto exit_reset;
     }
 
-    unsigned int chunk_size = min(size-svc->size, p->msg.data_length);
+    if (svc->size == 0) {
+        /* Data from previous read is not used anymore */
+        buff_release(svc);
+
+        /* Use data in place if it is not split across frames. String
+         * terminator replaces first byte of next message until it is
+         * read. */
+        if (svc->packet_len > size || (!string && svc->packet_len == size)) {
+            svc->buff = (char*)svc->packet_ptr;
+            svc->buff_size = 0;
+            svc->frame_len = size;
+
+            if (string) {
+                svc->frame_term = svc->buff + size;
+                svc->frame_term_c = *svc->frame_term;
+                *svc->frame_term = 0;
+            }
+
+            svc->packet_len -= size;
+            svc->packet_ptr += size;
+            return 0;
+        }
+    }
+
+    /* Keep room for string terminator */
+    if (buff_reserve(svc, size + 1)) {
+        ret = -ENOMEM;
+        goto exit_reset;
+    }
+
+    unsigned int chunk_size = min(size-svc->size, svc->packet_len);
 
     memcpy(svc->buff+svc->size, svc->packet_ptr, chunk_size);
 
     svc->size += chunk_size;
-    p->msg.data_length -= chunk_size;
+    svc->packet_len -= chunk_size;
     svc->packet_ptr += chunk_size;
 
     if (svc->size == size) {
+        svc->buff[size] = 0;
         ret = 0;
         goto exit_reset;
     }
@@ -239,27 +251,94 @@ exit_reset:
     return ret;
 }
 
-static int create_path_directories(char *name)
+static int dir_cache_lookup(afs_service_t *svc, const char *name)
 {
-    int ret;
-    char *x = name;
-    unsigned int mode = 0775;
+    int best = 0;
+#ifdef CONFIG_ADBD_FILE_DIR_CACHE
+    int i;
+    int len;
+    const char *dir;
 
-    if(name[0] != '/') return -1;
+    /* Find longest parent of name that is a cached directory or one of
+     * its parents */
 
-    for(;;) {
-        x = strchr(++x, '/');
-        if(!x) return 0;
-        *x = 0;
+    for (i = 0; i < CONFIG_ADBD_FILE_DIR_CACHE && svc->dir_cache[i]; i++) {
+        dir = svc->dir_cache[i];
+        for (len = 0; dir[len] && dir[len] == name[len]; len++);
 
-        ret = mkdir(name, mode);
-        *x = '/';
-        if((ret < 0) && (errno != EEXIST)) {
-            adb_err("mkdir <%s> failed: %d\n", name, errno);
-            return ret;
+        while (len > best &&
+               !(name[len] == '/' && (dir[len] == '/' || dir[len] == 0))) {
+            len--;
+        }
+
+        if (len > best) {
+            best = len;
         }
     }
-    return 0;
+#else
+    UNUSED(svc);
+    UNUSED(name);
+#endif
+
+    return best;
+}
+
+static void dir_cache_insert(afs_service_t *svc, const char *name, int len)
+{
+#ifdef CONFIG_ADBD_FILE_DIR_CACHE
+    int i;
+    char *entry = NULL;
+
+    for (i = 0; i < CONFIG_ADBD_FILE_DIR_CACHE && svc->dir_cache[i]; i++) {
+        if ((int)strlen(svc->dir_cache[i]) == len &&
+            !strncmp(svc->dir_cache[i], name, len)) {
+            entry = svc->dir_cache[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        /* Evict least recently used directory if cache is full */
+
+        if (i == CONFIG_ADBD_FILE_DIR_CACHE) {
+            i -= 1;
+            free(svc->dir_cache[i]);
+        }
+
+        entry = (char*)malloc(len+1);
+        if (entry == NULL) {
+            svc->dir_cache[i] = NULL;
+            return;
+        }
+        memcpy(entry, name, len);
+        entry[len] = 0;
+    }
+
+    /* Move entry to front */
+
+    memmove(&svc->dir_cache[1], &svc->dir_cache[0],
+            i * sizeof(svc->dir_cache[0]));
+    svc->dir_cache[0] = entry;
+#else
+    UNUSED(svc);
+    UNUSED(name);
+    UNUSED(len);
+#endif
+}
+
+static int dir_cache_flush(afs_service_t *svc)
+{
+    int i = 0;
+#ifdef CONFIG_ADBD_FILE_DIR_CACHE
+    for (; i < CONFIG_ADBD_FILE_DIR_CACHE && svc->dir_cache[i]; i++) {
+        free(svc->dir_cache[i]);
+        svc->dir_cache[i] = NULL;
+    }
+#else
+    UNUSED(svc);
+#endif
+
+    return i;
 }
 
 static void state_reset(afs_service_t *svc)
@@ -271,6 +350,13 @@ static void state_reset(afs_service_t *svc)
             break;
 
         case AFS_STATE_PROCESS_RECV:
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+            if (svc->recv.ra != NULL) {
+                /* File is closed once reads in progress are done */
+                afs_readahead_reset(svc);
+                break;
+            }
+#endif
             close(svc->recv.fd);
             break;
 
@@ -279,9 +365,37 @@ static void state_reset(afs_service_t *svc)
             free(svc->send_link.path);
             break;
 
+#ifdef CONFIG_ADBD_FILE_TREE
+        case AFS_STATE_PROCESS_TREE_RECV:
+        case AFS_STATE_PROCESS_TREE_SEND_HDR:
+        case AFS_STATE_PROCESS_TREE_SEND_DATA:
+            afs_tree_reset(svc);
+            break;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_DELTA
+        case AFS_STATE_PROCESS_SIGS:
+        case AFS_STATE_PROCESS_DELTA_HDR:
+        case AFS_STATE_PROCESS_DELTA_DATA:
+            afs_delta_reset(svc);
+            break;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_WALK
+        case AFS_STATE_PROCESS_WALK:
+            afs_walk_reset(svc);
+            break;
+#endif
+
         case AFS_STATE_PROCESS_SEND_FILE_HDR:
         case AFS_STATE_PROCESS_SEND_FILE_DATA:
             close(svc->send_file.fd);
+#ifdef CONFIG_ADBD_FILE_STORE
+            free(svc->send_file.store_path);
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+            free(svc->send_file.path);
+#endif
             /* TODO handle file unlink if transfer incomplete */
             break;
 
@@ -291,12 +405,17 @@ static void state_reset(afs_service_t *svc)
 
     svc->state = AFS_STATE_WAIT_CMD;
     svc->size = 0;
+    buff_release(svc);
 }
 
 static int state_init_stat(afs_service_t *svc, apacket *p)
 {
     struct stat st;
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    union syncmsg *msg = afs_reserve_reply(svc, p, sizeof(msg->stat));
+
+    if (msg == NULL) {
+        return -1;
+    }
 
     msg->stat.id = ID_STAT;
     p->write_len += sizeof(msg->stat);
@@ -320,7 +439,7 @@ static int state_init_stat(afs_service_t *svc, apacket *p)
 
 static int state_init_list(afs_service_t *svc, apacket *p)
 {
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    union syncmsg *msg;
 
     int len = strlen(svc->buff);
     /* PATH_MAX + "/" + 1 char filename at least + "\x0" => -3 */
@@ -329,7 +448,8 @@ static int state_init_list(afs_service_t *svc, apacket *p)
         goto exit_done;
     }
 
-    svc->list.path = (char*)malloc(PATH_MAX);
+    /* Room for directory, separator and any entry name */
+    svc->list.path = (char*)malloc(len + NAME_MAX + 2);
     if (svc->list.path == NULL) {
         adb_err("Cannot allocate dirname\n");
         goto exit_done;
@@ -351,6 +471,11 @@ static int state_init_list(afs_service_t *svc, apacket *p)
 exit_free:
     free(svc->list.path);
 exit_done:
+    msg = afs_reserve_reply(svc, p, sizeof(msg->dent));
+    if (msg == NULL) {
+        return -1;
+    }
+
     msg->dent.id = ID_DONE;
     msg->dent.mode = 0;
     msg->dent.size = 0;
@@ -363,68 +488,83 @@ exit_done:
 static int state_process_list(afs_service_t *svc, apacket *p)
 {
     int ret;
+    int len;
+    int remaining;
     struct dirent *de;
     struct stat st;
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    union syncmsg *msg;
 
-    /* Only send items one by one to ensure there is no overflow in packet */
+    /* Fill frame with entries, as long as any entry fits in it */
 
-    de = readdir(svc->list.d);
+    while (p->write_len == 0 ||
+           CONFIG_ADBD_PAYLOAD_SIZE - p->write_len >=
+               sizeof(msg->dent) + NAME_MAX) {
 
-    if (de == NULL) {
-        msg->dent.id = ID_DONE;
-        msg->dent.mode = 0;
-        msg->dent.size = 0;
-        msg->dent.time = 0;
-        msg->dent.namelen = 0;
-        p->write_len += sizeof(msg->dent);
-        return 0;
-    }
+        msg = afs_reserve_reply(svc, p,
+                                CONFIG_ADBD_PAYLOAD_SIZE - p->write_len);
+        if (msg == NULL) {
+            return -1;
+        }
+
+        de = readdir(svc->list.d);
+
+        if (de == NULL) {
+            msg->dent.id = ID_DONE;
+            msg->dent.mode = 0;
+            msg->dent.size = 0;
+            msg->dent.time = 0;
+            msg->dent.namelen = 0;
+            p->write_len += sizeof(msg->dent);
+            return 0;
+        }
 
-    int len = strlen(de->d_name);
+        len = strlen(de->d_name);
 
-    int remaining = PATH_MAX -
-        (int)(svc->list.file_ptr - svc->list.path);
+        /* Path buffer has room for NAME_MAX */
+        if (len > NAME_MAX) {
+            adb_err("filename <%s> too long to stat: %d/%d\n",
+                de->d_name, len, NAME_MAX);
+            msg->dent.mode = 0;
+            msg->dent.size = 0;
+            msg->dent.time = 0;
+        }
+        else {
+            /* Try to stat file */
+            memcpy(svc->list.file_ptr, de->d_name, len);
+            svc->list.file_ptr[len] = 0;
+
+            /* Do not follow symlinks */
+            if((ret = lstat(svc->list.path, &st))) {
+                adb_err("stat failed <%s> %d %d\n",
+                    svc->list.path, ret, errno);
+                st.st_mode = 0;
+                st.st_size = 0;
+                st.st_mtime = 0;
+            }
 
-    if (len >= remaining) {
-        adb_err("filename <%s> too long to stat: %d/%d\n",
-            de->d_name, len, remaining);
-        msg->dent.mode = 0;
-        msg->dent.size = 0;
-        msg->dent.time = 0;
-    }
-    else {
-        /* Try to stat file */
-        memcpy(svc->list.file_ptr, de->d_name, len);
-        svc->list.file_ptr[len] = 0;
+            msg->dent.mode = htoll(st.st_mode);
+            msg->dent.size = htoll(st.st_size);
+            msg->dent.time = htoll(st.st_mtime);
+        }
 
-        /* Do not follow symlinks */
-        if((ret = lstat(svc->list.path, &st))) {
-            adb_err("stat failed <%s> %d %d\n", svc->list.path, ret, errno);
-            st.st_mode = 0;
-            st.st_size = 0;
-            st.st_mtime = 0;
+        remaining = (int)(CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->dent) -
+                          p->write_len);
+        if (len > remaining) {
+            adb_err("filename <%s> too long: %d/%d\n",
+                de->d_name,
+                len,
+                remaining);
+            len = remaining;
         }
 
-        msg->dent.mode = htoll(st.st_mode);
-        msg->dent.size = htoll(st.st_size);
-        msg->dent.time = htoll(st.st_mtime);
-    }
+        msg->dent.id = ID_DENT;
+        msg->dent.namelen = htoll(len);
 
-    remaining = (int)(CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->dent) - p->write_len);
-    if (len > remaining) {
-        adb_err("filename <%s> too long: %d/%d\n",
-            de->d_name,
-            len,
-            remaining);
-        len = remaining;
+        memcpy((&msg->dent)+1, de->d_name, len);
+        p->write_len += sizeof(msg->dent) + len;
     }
 
-    msg->dent.id = ID_DENT;
-    msg->dent.namelen = htoll(len);
-
-    memcpy((&msg->dent)+1, de->d_name, len);
-    p->write_len += sizeof(msg->dent) + len;
+    /* Continue in next frame */
     return 1;
 }
 
@@ -432,6 +572,19 @@ static int state_init_send(afs_service_t *svc, apacket *p)
 {
     unsigned int mode;
     bool is_link;
+    int64_t offset = 0;
+
+#ifdef CONFIG_ADBD_FILE_STORE
+    if (svc->cmd == ID_SNDH && afs_take_arg64(svc, &svc->store_hash)) {
+        return afs_prepare_fail_message(svc, p, "invalid hash");
+    }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_RANGE
+    if (svc->cmd == ID_SNDO && afs_take_arg64(svc, (uint64_t*)&offset)) {
+        return afs_prepare_fail_message(svc, p, "invalid offset");
+    }
+#endif
 
     char* tmp = strrchr(svc->buff,',');
     if(tmp) {
@@ -445,35 +598,104 @@ static int state_init_send(afs_service_t *svc, apacket *p)
         is_link = 0;
     }
 
-    /* TODO always unlink or stat file ?
-     * Useless for regular files (O_CREAT | O_TRUNC)
-     * but may be required for symlinks or folders ?
-     */
-    unlink(svc->buff);
+#ifdef CONFIG_ADBD_FILE_RANGE
+    if (offset < SYNC_OFFSET_APPEND) {
+        return afs_prepare_fail_message(svc, p, "invalid offset");
+    }
+
+    if (offset > 0) {
+        struct stat st;
+
+        /* Resume offset must be within content already pushed, nothing
+         * is created otherwise */
+        if (stat(svc->buff, &st)) {
+            return afs_prepare_fail_errno(svc, p);
+        }
+        if (offset > st.st_size) {
+            return afs_prepare_fail_message(svc, p, "invalid offset");
+        }
+    }
+#endif
+
+    if (is_link) {
+        unlink(svc->buff);
+    }
 
-    if(create_path_directories(svc->buff) != 0) {
+    if(afs_create_path_directories(svc, svc->buff) != 0) {
         adb_err("failed to create path <%s>\n", svc->buff);
-        prepare_fail_errno(svc, p);
-        return 0;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+#ifdef CONFIG_ADBD_FILE_STORE
+    if (svc->cmd == ID_SNDH) {
+        /* Content is only sent by host if not found in store */
+        return afs_store_place(svc, p, is_link, mode);
     }
+#endif
 
     if (is_link) {
         return state_init_send_link(svc, p);
     }
 
-    return state_init_send_file(svc, p, mode);
+    return state_init_send_file(svc, p, mode, offset);
 }
 
-static int state_init_send_file(afs_service_t *svc, apacket *p, mode_t mode)
+static int state_init_send_file(afs_service_t *svc, apacket *p, mode_t mode,
+                                int64_t offset)
 {
-    svc->send_file.fd = open(svc->buff, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    /* Whole file is replaced unless resuming at an offset */
+    int flags = offset == 0 ? O_TRUNC : 0;
+
+    svc->send_file.fd = afs_open_send_file(svc, svc->buff, mode, flags);
 
     if(svc->send_file.fd < 0) {
         adb_err("failed to open file <%s> (fd=%d)\n",
             svc->buff, svc->send_file.fd);
-        prepare_fail_errno(svc, p);
-        return 0;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+#ifdef CONFIG_ADBD_FILE_RANGE
+    if (offset == SYNC_OFFSET_APPEND) {
+        offset = lseek(svc->send_file.fd, 0, SEEK_END);
+    }
+    else if (offset > 0) {
+        /* Drop content past resume offset, checked against file size
+         * before opening it */
+        if (ftruncate(svc->send_file.fd, offset) == 0) {
+            offset = lseek(svc->send_file.fd, offset, SEEK_SET);
+        }
+        else {
+            offset = -1;
+        }
+    }
+
+    if (offset < 0) {
+        int ret = afs_prepare_fail_errno(svc, p);
+        close(svc->send_file.fd);
+        return ret;
+    }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    send_file_init_sparse(svc, offset);
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+    svc->send_file.crc = 0;
+    svc->send_file.host_crc_set = 0;
+    svc->send_file.path = NULL;
+    if (svc->crc_enabled) {
+        svc->send_file.path = strdup(svc->buff);
+        if (svc->send_file.path == NULL) {
+            close(svc->send_file.fd);
+            return afs_prepare_fail_message(svc, p, "out of memory");
+        }
     }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_STORE
+    afs_store_begin(svc);
+#endif
 
     svc->state = AFS_STATE_PROCESS_SEND_FILE_HDR;
     return 1;
@@ -485,14 +707,12 @@ static int state_init_send_link(afs_service_t *svc, apacket *p)
 
     len = strlen(svc->buff);
     if (len >= PATH_MAX) {
-        prepare_fail_message(svc, p, "path too long");
-        return 0;
+        return afs_prepare_fail_message(svc, p, "path too long");
     }
     svc->send_link.path = (char*)malloc(len+1);
     if (svc->send_link.path == NULL) {
         adb_err("Cannot allocate dirname\n");
-        prepare_fail_message(svc, p, "out of memory");
-        return 0;
+        return afs_prepare_fail_message(svc, p, "out of memory");
     }
 
     memcpy(svc->send_link.path, svc->buff, len);
@@ -504,25 +724,61 @@ static int state_init_send_link(afs_service_t *svc, apacket *p)
 static int state_process_send_header(afs_service_t *svc, apacket *p)
 {
     int ret;
-    union syncmsg *msg = (union syncmsg*)svc->buff;
+    union syncmsg *msg;
 
-    ret = read_from_packet(svc, p, sizeof(msg->data));
+    ret = afs_read_from_packet(svc, sizeof(msg->data));
     if (ret != 0) {
         if (ret == -EAGAIN) {
             return 1;
         }
-        prepare_fail_message(svc, p, "read error");
-        return 0;
+        return afs_prepare_fail_message(svc, p, "read error");
+    }
+
+    msg = (union syncmsg*)svc->buff;
+
+#ifdef CONFIG_ADBD_FILE_CRC
+    if (msg->data.id == ID_CSUM &&
+        svc->state == AFS_STATE_PROCESS_SEND_FILE_HDR) {
+        /* Checksum of content computed by host, checked on DONE */
+        svc->send_file.host_crc = ltohl(msg->data.size);
+        svc->send_file.host_crc_set = 1;
+        return 1;
     }
+#endif
 
     if(msg->data.id != ID_DATA) {
         if(msg->data.id == ID_DONE) {
-            prepare_okay_message(svc, p);
-            return 0;
+#ifdef CONFIG_ADBD_FILE_CRC
+            if (svc->crc_enabled &&
+                svc->state == AFS_STATE_PROCESS_SEND_FILE_HDR &&
+                (!svc->send_file.host_crc_set ||
+                 svc->send_file.host_crc != svc->send_file.crc)) {
+                adb_err("checksum mismatch %08x %08x\n",
+                    svc->send_file.host_crc, svc->send_file.crc);
+                /* Do not leave corrupted content at destination */
+                if (svc->send_file.path != NULL) {
+                    unlink(svc->send_file.path);
+                }
+                return afs_prepare_fail_message(svc, p, "checksum mismatch");
+            }
+#endif
+#ifdef CONFIG_ADBD_FILE_SPARSE
+            if (svc->state == AFS_STATE_PROCESS_SEND_FILE_HDR &&
+                svc->send_file.zero_tail &&
+                ftruncate(svc->send_file.fd, svc->send_file.pos)) {
+                /* Set length of file ending with skipped zeros */
+                return afs_prepare_fail_errno(svc, p);
+            }
+#endif
+#ifdef CONFIG_ADBD_FILE_STORE
+            if (svc->state == AFS_STATE_PROCESS_SEND_FILE_HDR) {
+                afs_store_commit(svc);
+            }
+#endif
+            return afs_prepare_okay_message(svc, p);
         }
         adb_log("Data message is 0x%x\n", msg->data.id);
-        prepare_fail_message(svc, p, "invalid data message");
-        return 0;
+        return afs_prepare_fail_message(svc, p, "invalid data message");
     }
 
     /* Read file length */
@@ -532,68 +788,189 @@ static int state_process_send_header(afs_service_t *svc, apacket *p)
     return 1;
 }
 
-static int state_process_send_file(afs_service_t *svc, apacket *p)
+#ifdef CONFIG_ADBD_FILE_SPARSE
+static void send_file_init_sparse(afs_service_t *svc, off_t offset)
 {
-    int ret;
-    int block_size = min(p->msg.data_length, svc->namelen);
-    uint8_t *write_ptr = svc->packet_ptr;
+    struct stat st;
 
-    svc->namelen -= block_size;
-    p->msg.data_length -= block_size;
-    svc->packet_ptr += block_size;
+    svc->send_file.blksize = 0;
+    svc->send_file.zero_tail = 0;
 
-    if (svc->send_file.fd >= 0) {
+    /* File is written past its end, skipped ranges of a regular file
+     * read as zeros */
 
-        /* Write data to file */
-        while (block_size > 0) {
-            ret = write(svc->send_file.fd, write_ptr, block_size);
-            if (ret > 0) {
-                write_ptr += ret;
-                block_size -= ret;
-                continue;
-            }
-            if (ret < 0 && errno == EINTR) {
-                continue;
-            }
-            /* TODO handle nonblocking io */
-            adb_err("write error %d %d\n", ret, errno);
-            prepare_fail_message(svc, p, "write error");
-            return 0;
-        }
+    if (!svc->skip_zeros || fstat(svc->send_file.fd, &st) ||
+        !S_ISREG(st.st_mode)) {
+        return;
     }
 
-    /* Wait for DONE frame */
-    if (svc->namelen == 0)
-        svc->state -= 1;
+    svc->send_file.pos = offset;
+    svc->send_file.blksize = st.st_blksize > 0 ? st.st_blksize : 4096;
+}
 
-    return 1;
+static bool is_zero(const uint8_t *ptr, unsigned len)
+{
+    /* Compare buffer with itself shifted by one byte, so vectorized
+     * memcmp from libc does the scan */
+    return ptr[0] == 0 && !memcmp(ptr, ptr + 1, len - 1);
 }
 
-#ifdef CONFIG_ADBD_FILE_SYMLINK
-static int state_process_send_sym(afs_service_t *svc, apacket *p) {
+static int send_file_write_sparse(afs_service_t *svc, const uint8_t *ptr,
+                                  unsigned len)
+{
     int ret;
+    unsigned piece;
 
-    ret = read_from_packet(svc, p, svc->namelen);
-    if (ret != 0) {
-        if (ret == -EAGAIN) {
-            return 1;
-        }
-        prepare_fail_message(svc, p, "read error");
-        return 0;
-    }
+    while (len > 0) {
+        /* Split data on filesystem block boundaries, so blocks only made
+         * of zeros are never written */
 
-    if (svc->namelen >= SYNC_TEMP_BUFF_SIZE) {
-        prepare_fail_message(svc, p, "symlink target too long");
-        return 0;
-    }
+        piece = svc->send_file.blksize -
+                svc->send_file.pos % svc->send_file.blksize;
+        piece = min(piece, len);
 
-    svc->buff[svc->namelen] = 0;
-    ret = symlink(svc->buff, svc->send_link.path);
+        if (is_zero(ptr, piece)) {
+            svc->skipped_bytes += piece;
+            svc->send_file.zero_tail = 1;
+        }
+        else {
+            ret = pwrite(svc->send_file.fd, ptr, piece, svc->send_file.pos);
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                adb_err("write error %d %d\n", ret, errno);
+                return -1;
+            }
+            piece = ret;
+            svc->send_file.zero_tail = 0;
+        }
 
-    if (ret) {
-        adb_err("symlink failed %d %d\n", ret, errno);
-        prepare_fail_message(svc, p, "symlink call failed");
-        return 0;
+        svc->send_file.pos += piece;
+        ptr += piece;
+        len -= piece;
+    }
+
+    return 0;
+}
+
+static int state_init_sparse(afs_service_t *svc, apacket *p)
+{
+    uint64_t enable;
+    union syncmsg *msg;
+
+    if (afs_take_arg64(svc, &enable)) {
+        return afs_prepare_fail_message(svc, p, "invalid argument");
+    }
+
+    msg = afs_reserve_reply(svc, p, sizeof(msg->sparse));
+    if (msg == NULL) {
+        return -1;
+    }
+
+    /* Reply with bytes skipped so far in session */
+    svc->skip_zeros = enable != 0;
+
+    msg->sparse.id = ID_SPRS;
+    msg->sparse.skipped[0] = htoll((uint32_t)svc->skipped_bytes);
+    msg->sparse.skipped[1] = htoll((uint32_t)(svc->skipped_bytes >> 32));
+    p->write_len += sizeof(msg->sparse);
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+static int state_init_checksum(afs_service_t *svc, apacket *p)
+{
+    uint64_t enable;
+
+    if (afs_take_arg64(svc, &enable)) {
+        return afs_prepare_fail_message(svc, p, "invalid argument");
+    }
+
+    /* Applies to next file transfers of session */
+    svc->crc_enabled = enable != 0;
+    return afs_prepare_okay_message(svc, p);
+}
+#endif
+
+static int state_process_send_file(afs_service_t *svc, apacket *p)
+{
+    int ret;
+    int block_size = min(svc->packet_len, svc->namelen);
+    uint8_t *write_ptr = svc->packet_ptr;
+
+    svc->namelen -= block_size;
+    svc->packet_len -= block_size;
+    svc->packet_ptr += block_size;
+
+#ifdef CONFIG_ADBD_FILE_STORE
+    if (svc->send_file.store_path != NULL) {
+        afs_xxh64_update(&svc->send_file.store_xxh, write_ptr, block_size);
+    }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+    if (svc->crc_enabled) {
+        svc->send_file.crc = afs_crc32c(svc->send_file.crc, write_ptr,
+                                        block_size);
+    }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    if (svc->send_file.blksize > 0) {
+        if (send_file_write_sparse(svc, write_ptr, block_size)) {
+            return afs_prepare_fail_message(svc, p, "write error");
+        }
+        block_size = 0;
+    }
+#endif
+
+    if (svc->send_file.fd >= 0) {
+
+        /* Write data to file */
+        while (block_size > 0) {
+            ret = write(svc->send_file.fd, write_ptr, block_size);
+            if (ret > 0) {
+                write_ptr += ret;
+                block_size -= ret;
+                continue;
+            }
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            /* TODO handle nonblocking io */
+            adb_err("write error %d %d\n", ret, errno);
+            return afs_prepare_fail_message(svc, p, "write error");
+        }
+    }
+
+    /* Wait for DONE frame */
+    if (svc->namelen == 0)
+        svc->state -= 1;
+
+    return 1;
+}
+
+#ifdef CONFIG_ADBD_FILE_SYMLINK
+static int state_process_send_sym(afs_service_t *svc, apacket *p) {
+    int ret;
+
+    ret = read_from_packet(svc, svc->namelen, 1);
+    if (ret != 0) {
+        if (ret == -EAGAIN) {
+            return 1;
+        }
+        return afs_prepare_fail_message(svc, p, "read error");
+    }
+    ret = symlink(svc->buff, svc->send_link.path);
+    if (ret && afs_retry_path_directories(svc, svc->send_link.path) == 0) {
+        ret = symlink(svc->buff, svc->send_link.path);
+    }
+
+    if (ret) {
+        adb_err("symlink failed %d %d\n", ret, errno);
+        return afs_prepare_fail_message(svc, p, "symlink call failed");
     }
 
     /* Wait for DONE frame */
@@ -602,34 +979,206 @@ static int state_process_send_sym(afs_service_t *svc, apacket *p) {
 }
 #endif
 
+static int state_init_unlink(afs_service_t *svc, apacket *p)
+{
+    int ret;
+
+    /* Removed path may be a cached directory */
+
+    dir_cache_flush(svc);
+
+    ret = unlink(svc->buff);
+    if (ret < 0 && (errno == EISDIR || errno == EPERM)) {
+        ret = rmdir(svc->buff);
+    }
+
+    if (ret < 0) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    return afs_prepare_okay_message(svc, p);
+}
+
 static int state_init_recv(afs_service_t *svc, apacket *p)
 {
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+    int ret;
+#endif
+    int64_t offset = 0;
+    uint64_t length = 0;
+
+#ifdef CONFIG_ADBD_FILE_RANGE
+    if (svc->cmd == ID_RCVR &&
+        (afs_take_arg64(svc, (uint64_t*)&offset) ||
+         afs_take_arg64(svc, &length))) {
+        return afs_prepare_fail_message(svc, p, "invalid range");
+    }
+#endif
+
     svc->recv.fd = open(svc->buff, O_RDONLY);
     if(svc->recv.fd < 0) {
         adb_err("Cannot open file <%s> for read %d\n",
             svc->buff, errno);
-        prepare_fail_message(svc, p, "file does not exist");
-        return 0;
+        return afs_prepare_fail_message(svc, p, "file does not exist");
     }
 
-    /* FIXME handle non blocking io ? */
-    // flags = fcntl(svc->recv.fd, F_GETFL, 0);
-    // fcntl(svc->recv.fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef CONFIG_ADBD_FILE_RANGE
+    if (offset < 0) {
+        /* Offset is relative to end of file */
+        struct stat st;
+
+        if (fstat(svc->recv.fd, &st)) {
+            close(svc->recv.fd);
+            return afs_prepare_fail_errno(svc, p);
+        }
+        offset = offset + st.st_size < 0 ? 0 : offset + st.st_size;
+    }
+#endif
+
+    /* Zero length reads whole file */
+    svc->recv.offset = offset;
+    svc->recv.remaining = length > 0 ? length : UINT64_MAX;
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    svc->recv.sparse = svc->cmd == ID_RCVS;
+    svc->recv.data_end = 0;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_CRC
+    svc->recv.crc = 0;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+    svc->recv.ra = NULL;
+#endif
 
     svc->state = AFS_STATE_PROCESS_RECV;
+
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+    ret = state_process_recv(svc, p);
+    if (ret == 1) {
+        /* First frame is read in place, read next ones ahead */
+        afs_readahead_start(svc);
+    }
+    return ret;
+#else
     return state_process_recv(svc, p);
+#endif
+}
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+static off_t recv_find_data(afs_service_t *svc)
+{
+    off_t data;
+
+    if (svc->recv.offset < svc->recv.data_end) {
+        return svc->recv.offset;
+    }
+
+    data = lseek(svc->recv.fd, svc->recv.offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno != ENXIO) {
+            /* Holes not supported by filesystem, send all content */
+            svc->recv.sparse = 0;
+            return svc->recv.offset;
+        }
+
+        /* Only a hole is left until end of file */
+        data = lseek(svc->recv.fd, 0, SEEK_END);
+        if (data < svc->recv.offset) {
+            data = svc->recv.offset;
+        }
+        svc->recv.data_end = data;
+        return data;
+    }
+
+    svc->recv.data_end = lseek(svc->recv.fd, data, SEEK_HOLE);
+    if (svc->recv.data_end <= data) {
+        svc->recv.sparse = 0;
+    }
+    return data;
 }
+#endif
 
 static int state_process_recv(afs_service_t *svc, apacket *p)
 {
     int ret;
-    union syncmsg *msg = (union syncmsg*)(p->data + p->write_len);
+    size_t size;
+    union syncmsg *msg;
+
+    /* Use all space left in frame */
+
+    msg = afs_reserve_reply(svc, p, CONFIG_ADBD_PAYLOAD_SIZE - p->write_len);
+    if (msg == NULL) {
+        return -1;
+    }
 
-    ret = read(svc->recv.fd,
-        (&msg->data)+1,
-        CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len);
+    size = min(CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len,
+               svc->recv.remaining);
+
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    while (svc->recv.sparse && svc->recv.remaining > 0) {
+        off_t hole;
+        off_t data = recv_find_data(svc);
+
+        if (data <= svc->recv.offset) {
+            /* Do not read past current data region */
+            if (svc->recv.sparse) {
+                size = min(size, (uint64_t)(svc->recv.data_end - data));
+            }
+            break;
+        }
+
+        /* Report hole instead of sending zeros */
+        hole = min(data - svc->recv.offset, SYNC_HOLE_MAX);
+        msg->data.id = ID_HOLE;
+        msg->data.size = htoll(hole);
+        svc->recv.offset += hole;
+        svc->recv.remaining -= hole;
+        p->write_len += sizeof(msg->data);
+
+        if (svc->recv.offset < data) {
+            /* Hole is larger than one message, look data up again */
+            svc->recv.data_end = 0;
+        }
+
+        if (CONFIG_ADBD_PAYLOAD_SIZE - p->write_len <= 2*sizeof(msg->data)) {
+            /* Continue in next frame */
+            return 1;
+        }
+
+        msg = (union syncmsg*)(p->data + p->write_len);
+        size = min(CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len,
+                   svc->recv.remaining);
+    }
+#endif
+
+#ifdef CONFIG_ADBD_FILE_READAHEAD
+    if (svc->recv.ra != NULL) {
+        ret = afs_readahead_read(svc, (&msg->data)+1, size);
+        if (ret < 0 && errno == EAGAIN) {
+            if (p->write_len > 0) {
+                /* Send replies, continue in next frame */
+                return 1;
+            }
+            return afs_readahead_wait(svc, p);
+        }
+    }
+    else
+#endif
+    ret = pread(svc->recv.fd, (&msg->data)+1, size, svc->recv.offset);
 
     if (ret > 0) {
+        svc->recv.offset += ret;
+        svc->recv.remaining -= ret;
+
+#ifdef CONFIG_ADBD_FILE_CRC
+        if (svc->crc_enabled) {
+            svc->recv.crc = afs_crc32c(svc->recv.crc,
+                                       (uint8_t*)((&msg->data)+1), ret);
+        }
+#endif
+
         msg->data.id = ID_DATA;
         msg->data.size = htoll(ret);
         p->write_len += sizeof(msg->data) + ret;
@@ -637,6 +1186,21 @@ static int state_process_recv(afs_service_t *svc, apacket *p)
     }
 
     if (ret == 0) {
+#ifdef CONFIG_ADBD_FILE_CRC
+        if (svc->crc_enabled) {
+            if (CONFIG_ADBD_PAYLOAD_SIZE - p->write_len <
+                2 * sizeof(msg->status)) {
+                /* Continue in next frame */
+                return 1;
+            }
+
+            /* Checksum of content precedes DONE */
+            msg->data.id = ID_CSUM;
+            msg->data.size = htoll(svc->recv.crc);
+            p->write_len += sizeof(msg->data);
+            msg = (union syncmsg*)(p->data + p->write_len);
+        }
+#endif
         msg->status.id = ID_DONE;
         msg->status.msglen = 0;
         p->write_len += sizeof(msg->status);
@@ -646,8 +1210,7 @@ static int state_process_recv(afs_service_t *svc, apacket *p)
     /* TODO handle non blocking and EAGAIN */
 
     adb_err("read failed %d %d\n", ret, errno);
-    prepare_fail_message(svc, p, "read failed");
-    return 0;
+    return afs_prepare_fail_message(svc, p, "read failed");
 }
 
 static int state_wait_cmd(afs_service_t *svc, apacket *p)
@@ -655,7 +1218,9 @@ static int state_wait_cmd(afs_service_t *svc, apacket *p)
     int ret;
     union syncmsg *msg;
 
-    ret = read_from_packet(svc, p, sizeof(msg->req));
+    UNUSED(p);
+
+    ret = afs_read_from_packet(svc, sizeof(msg->req));
     if (ret != 0) {
         if (ret == -EAGAIN) {
             return 1;
@@ -686,7 +1251,7 @@ static int state_wait_cmd_data(afs_service_t *svc, apacket *p)
 {
     int ret;
 
-    ret = read_from_packet(svc, p, svc->namelen);
+    ret = read_from_packet(svc, svc->namelen, 1);
     if (ret != 0) {
         if (ret == -EAGAIN) {
             return 1;
@@ -694,11 +1259,12 @@ static int state_wait_cmd_data(afs_service_t *svc, apacket *p)
         return -1;
     }
 
-    if (svc->namelen >= SYNC_TEMP_BUFF_SIZE) {
-        return -1;
+#ifdef CONFIG_ADBD_FILE_STORE
+    if (svc->cmd != ID_SEND) {
+        /* Content hash is only valid for next request */
+        svc->store_offer = 0;
     }
-
-    svc->buff[svc->namelen] = 0;
+#endif
 
     switch(svc->cmd) {
     case ID_STAT:
@@ -708,11 +1274,73 @@ static int state_wait_cmd_data(afs_service_t *svc, apacket *p)
         ret = state_init_list(svc, p);
         break;
     case ID_SEND:
+#ifdef CONFIG_ADBD_FILE_STORE
+    case ID_SNDH:
+#endif
+#ifdef CONFIG_ADBD_FILE_RANGE
+    case ID_SNDO:
+#endif
         ret = state_init_send(svc, p);
         break;
     case ID_RECV:
+#ifdef CONFIG_ADBD_FILE_RANGE
+    case ID_RCVR:
+#endif
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    case ID_RCVS:
+#endif
         ret = state_init_recv(svc, p);
         break;
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    case ID_SPRS:
+        ret = state_init_sparse(svc, p);
+        break;
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+    case ID_CSUM:
+        ret = state_init_checksum(svc, p);
+        break;
+#endif
+    case ID_ULNK:
+        ret = state_init_unlink(svc, p);
+        break;
+#ifdef CONFIG_ADBD_FILE_HASH
+    case ID_HASH:
+        ret = afs_state_init_hash(svc, p);
+        break;
+#endif
+#ifdef CONFIG_ADBD_FILE_TREE
+    case ID_TRCV:
+        ret = afs_state_init_tree_recv(svc, p);
+        break;
+    case ID_TSND:
+        ret = afs_state_init_tree_send(svc, p);
+        break;
+#endif
+#ifdef CONFIG_ADBD_FILE_DELTA
+    case ID_SIGS:
+        ret = afs_state_init_sigs(svc, p);
+        break;
+    case ID_DLTA:
+        ret = afs_state_init_delta(svc, p);
+        break;
+#endif
+#ifdef CONFIG_ADBD_FILE_WALK
+    case ID_WALK:
+        ret = afs_state_init_walk(svc, p);
+        break;
+#endif
+#ifdef CONFIG_ADBD_FILE_OPS
+    case ID_MOVE:
+    case ID_RMRF:
+        /* Moved or removed path may be a cached directory */
+        dir_cache_flush(svc);
+        ret = afs_state_init_fileop(svc, p);
+        break;
+    case ID_COPY:
+        ret = afs_state_init_fileop(svc, p);
+        break;
+#endif
 
     case ID_QUIT:
         // adb_log("got QUIT command\n");
@@ -727,16 +1355,39 @@ static int state_wait_cmd_data(afs_service_t *svc, apacket *p)
     return ret;
 }
 
-static int file_sync_on_write(adb_service_t *service, apacket *p) {
-    int ret = 0;
-    afs_service_t *svc = container_of(service, afs_service_t, service);
-    svc->packet_ptr = p->data;
+static bool reply_stream_active(afs_service_t *svc)
+{
+    switch (svc->state) {
+        case AFS_STATE_PROCESS_RECV:
+        case AFS_STATE_PROCESS_LIST:
+#ifdef CONFIG_ADBD_FILE_TREE
+        case AFS_STATE_PROCESS_TREE_RECV:
+#endif
+#ifdef CONFIG_ADBD_FILE_DELTA
+        case AFS_STATE_PROCESS_SIGS:
+#endif
+#ifdef CONFIG_ADBD_FILE_WALK
+        case AFS_STATE_PROCESS_WALK:
+#endif
+            return true;
 
-    /* Process all packet data */
+        default:
+            return false;
+    }
+}
 
-    while (p->msg.data_length > 0 && ret >= 0) {
+static int process_requests(afs_service_t *svc, apacket *p)
+{
+    int ret;
+
+    while (svc->packet_len > 0) {
         switch(svc->state) {
             case AFS_STATE_WAIT_CMD:
+                if (svc->size == 0 &&
+                    CONFIG_ADBD_PAYLOAD_SIZE - p->write_len < SYNC_REPLY_MIN) {
+                    /* Reply frame is full, send it before next request */
+                    return 1;
+                }
                 ret = state_wait_cmd(svc, p);
                 break;
             case AFS_STATE_WAIT_CMD_DATA:
@@ -761,6 +1412,42 @@ static int file_sync_on_write(adb_service_t *service, apacket *p) {
 #endif
                 break;
 
+#ifdef CONFIG_ADBD_FILE_TREE
+            case AFS_STATE_PROCESS_TREE_SEND_HDR:
+                ret = afs_state_process_tree_send_header(svc, p);
+                break;
+
+            case AFS_STATE_PROCESS_TREE_SEND_DATA:
+                ret = afs_state_process_tree_send_data(svc, p);
+                break;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_DELTA
+            case AFS_STATE_PROCESS_DELTA_HDR:
+                ret = afs_state_process_delta_header(svc, p);
+                break;
+
+            case AFS_STATE_PROCESS_DELTA_DATA:
+                ret = afs_state_process_delta_data(svc, p);
+                break;
+
+            case AFS_STATE_PROCESS_SIGS:
+#endif
+#ifdef CONFIG_ADBD_FILE_WALK
+            case AFS_STATE_PROCESS_WALK:
+#endif
+#ifdef CONFIG_ADBD_FILE_TREE
+            case AFS_STATE_PROCESS_TREE_RECV:
+#endif
+            case AFS_STATE_PROCESS_RECV:
+            case AFS_STATE_PROCESS_LIST:
+                /* Next request is processed once reply stream is done */
+                return 1;
+
+            case AFS_STATE_WAIT_WORK:
+                /* Next request is processed once worker is done */
+                return AFS_PROCESS_ASYNC;
+
             default:
                 adb_err("Unexpected state %d\n", svc->state);
                 ret = -1;
@@ -769,39 +1456,215 @@ static int file_sync_on_write(adb_service_t *service, apacket *p) {
         /* process done or error, reset state */
         if (ret <= 0) {
             state_reset(svc);
+            if (ret < 0) {
+                return ret;
+            }
         }
     }
 
-    /* process ok, wait for next frame */
-    return ret >= 0 ? 0 : ret;
+    return svc->state == AFS_STATE_WAIT_WORK ? AFS_PROCESS_ASYNC : 0;
 }
 
-static int file_sync_on_ack(adb_service_t *service, apacket *p) {
+static int resume_requests(afs_service_t *svc, apacket *p)
+{
+    int ret;
+
+    ret = process_requests(svc, p);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ret == AFS_PROCESS_ASYNC) {
+        /* Keep packet for reply */
+        svc->work_packet = p;
+        return 1;
+    }
+
+    /* Request data must not refer to frame once it is sent */
+    if (buff_detach(svc)) {
+        return -1;
+    }
+
+    if (ret == 0) {
+        free(svc->pending);
+        svc->pending = NULL;
+
+        if (svc->delayed_ack) {
+            /* All requests processed, acknowledge frame */
+            return send_replies_and_ack(svc, p);
+        }
+    }
+    else if (svc->pending == NULL && svc->packet_len > 0) {
+        /* Reply frame is full. Keep remaining requests aside until
+         * replies are acknowledged. */
+        if (stash_requests(svc)) {
+            return -1;
+        }
+    }
+
+    if (p->write_len == 0) {
+        adb_hal_apacket_release(svc->client, p);
+        return 1;
+    }
+
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(svc->client, p);
+    return 1;
+}
+
+static int send_replies_and_ack(afs_service_t *svc, apacket *p)
+{
+    apacket *ack;
+
+    if (p->write_len == 0) {
+        svc->delayed_ack = 0;
+        adb_send_okay_frame(svc->client, p,
+            svc->service.id, svc->service.peer_id);
+        return 1;
+    }
+
+    /* Replies must be queued before acknowledge: replies to next frame
+     * may be sent before payload of an OKAY frame. */
+
+    ack = adb_hal_apacket_allocate(svc->client);
+    if (ack != NULL) {
+        svc->delayed_ack = 0;
+    }
+
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(svc->client, p);
+
+    if (ack != NULL) {
+        adb_send_okay_frame(svc->client, ack,
+            svc->service.id, svc->service.peer_id);
+    }
+
+    /* Otherwise frame is acknowledged once replies are acknowledged */
+    return 1;
+}
+
+static void file_sync_after_work(void *arg)
+{
     int ret;
+    afs_service_t *svc = (afs_service_t*)arg;
+    apacket *p = svc->work_packet;
+
+    /* Restore state of request that queued work */
+    svc->state = svc->work_state;
+
+    if (p == NULL) {
+        /* Service was closed while work was in progress */
+        file_sync_release(svc);
+        return;
+    }
+
+    svc->work_packet = NULL;
+
+    ret = svc->work_reply_cb(svc, p);
+    if (ret <= 0) {
+        state_reset(svc);
+    }
+
+    if (ret >= 0) {
+        ret = resume_requests(svc, p);
+    }
+
+    if (ret < 0) {
+        adb_service_close(svc->client, &svc->service, p);
+    }
+}
+
+static void file_sync_work(void *arg)
+{
+    afs_service_t *svc = (afs_service_t*)arg;
+    svc->work_cb(svc);
+}
+
+static void file_sync_release(afs_service_t *svc)
+{
+    state_reset(svc);
+    dir_cache_flush(svc);
+    free(svc->pending);
+    free(svc);
+}
+
+static int file_sync_on_write(adb_service_t *service, apacket *p) {
     afs_service_t *svc = container_of(service, afs_service_t, service);
+
+    if (svc->delayed_ack) {
+        adb_err("frame received before acknowledge\n");
+        return -1;
+    }
+
     svc->packet_ptr = p->data;
+    svc->packet_len = p->msg.data_length;
+
+    /* Process all requests from packet. Replies are written at the start
+     * of the same packet. Frame is acknowledged once all its requests
+     * are processed. */
+
+    svc->delayed_ack = 1;
+
+    if (reply_stream_active(svc)) {
+        /* Reply stream in progress: frame cannot hold replies. Keep
+         * requests aside until stream is done, frame is acknowledged
+         * once they are processed. */
+        if (stash_requests(svc)) {
+            return -1;
+        }
+        adb_hal_apacket_release(svc->client, p);
+        return 1;
+    }
+
+    return resume_requests(svc, p);
+}
+
+static int file_sync_on_ack(adb_service_t *service, apacket *p) {
+    int ret;
+    afs_service_t *svc = container_of(service, afs_service_t, service);
 
     /* No data in notify packet */
     switch (svc->state) {
         case AFS_STATE_PROCESS_RECV:
             ret = state_process_recv(svc, p);
+            if (ret == AFS_PROCESS_ASYNC) {
+                /* Frame is kept until file content is read */
+                return 1;
+            }
             break;
 
         case AFS_STATE_PROCESS_LIST:
             ret = state_process_list(svc, p);
             break;
 
-        case AFS_STATE_PROCESS_SEND_FILE_HDR:
-        case AFS_STATE_PROCESS_SEND_SYM_HDR:
-        case AFS_STATE_WAIT_CMD:
-            /* Nothing to do */
-            ret = 0;
+#ifdef CONFIG_ADBD_FILE_TREE
+        case AFS_STATE_PROCESS_TREE_RECV:
+            ret = afs_state_process_tree_recv(svc, p);
             break;
+#endif
 
-        default:
-            adb_err("ERROR state %d\n", svc->state);
-            ret = -1;
+#ifdef CONFIG_ADBD_FILE_DELTA
+        case AFS_STATE_PROCESS_SIGS:
+            ret = afs_state_process_sigs(svc, p);
+            break;
+#endif
+
+#ifdef CONFIG_ADBD_FILE_WALK
+        case AFS_STATE_PROCESS_WALK:
+            ret = afs_state_process_walk(svc, p);
             break;
+#endif
+
+        case AFS_STATE_WAIT_WORK:
+            /* Requests are resumed once worker is done */
+            return 0;
+
+        default:
+            /* No reply stream in progress */
+            ret = 0;
+            goto process_pending;
     }
 
     if (ret > 0) {
@@ -811,13 +1674,30 @@ static int file_sync_on_ack(adb_service_t *service, apacket *p) {
 
     /* process done or error, reset state */
     state_reset(svc);
-    return ret;
+    if (ret < 0) {
+        return ret;
+    }
+
+process_pending:
+    if (svc->packet_len == 0 && !svc->delayed_ack) {
+        return 0;
+    }
+
+    /* Process requests kept aside, acknowledge host frame when done */
+    return resume_requests(svc, p);
 }
 
 static void file_sync_on_close(struct adb_service_s *service) {
     afs_service_t *svc = container_of(service, afs_service_t, service);
-    state_reset(svc);
-    free(svc);
+
+    if (svc->state == AFS_STATE_WAIT_WORK) {
+        /* Service is released once worker is done */
+        adb_hal_apacket_release(svc->client, svc->work_packet);
+        svc->work_packet = NULL;
+        return;
+    }
+
+    file_sync_release(svc);
 }
 
 static const adb_service_ops_t file_sync_ops = {
@@ -831,7 +1711,7 @@ static const adb_service_ops_t file_sync_ops = {
  * Public Functions
  ****************************************************************************/
 
-adb_service_t* file_sync_service(const char *params)
+adb_service_t* file_sync_service(adb_client_t *client, const char *params)
 {
     UNUSED(params);
     afs_service_t *service =
@@ -841,9 +1721,309 @@ adb_service_t* file_sync_service(const char *params)
         return NULL;
     }
 
+    service->client = client;
+    service->packet_len = 0;
+    service->pending = NULL;
+    service->delayed_ack = 0;
+    service->work_packet = NULL;
     service->size = 0;
+    service->buff = service->buff_inline;
+    service->buff_size = sizeof(service->buff_inline);
+    service->frame_term = NULL;
     service->state = AFS_STATE_WAIT_CMD;
+#ifdef CONFIG_ADBD_FILE_STORE
+    service->store_offer = 0;
+#endif
+#ifdef CONFIG_ADBD_FILE_SPARSE
+    service->skipped_bytes = 0;
+    service->skip_zeros = 0;
+#endif
+#ifdef CONFIG_ADBD_FILE_CRC
+    service->crc_enabled = 0;
+#endif
+#ifdef CONFIG_ADBD_FILE_DIR_CACHE
+    memset(service->dir_cache, 0, sizeof(service->dir_cache));
+#endif
     service->service.ops = &file_sync_ops;
 
     return &service->service;
 }
+
+int afs_read_from_packet(afs_service_t *svc, unsigned int size)
+{
+    return read_from_packet(svc, size, 0);
+}
+
+int afs_create_path_directories(afs_service_t *svc, char *name)
+{
+    int ret;
+    char *x;
+    unsigned int mode = 0775;
+
+    if(name[0] != '/') return -1;
+
+    /* Skip directories known to exist */
+
+    x = name + dir_cache_lookup(svc, name);
+
+    for(;;) {
+        x = strchr(++x, '/');
+        if(!x) break;
+        *x = 0;
+
+        ret = mkdir(name, mode);
+        *x = '/';
+        if((ret < 0) && (errno != EEXIST)) {
+            adb_err("mkdir <%s> failed: %d\n", name, errno);
+            dir_cache_flush(svc);
+            return ret;
+        }
+    }
+
+    x = strrchr(name, '/');
+    if (x != name) {
+        dir_cache_insert(svc, name, x - name);
+    }
+    return 0;
+}
+
+int afs_retry_path_directories(afs_service_t *svc, char *name)
+{
+    /* Cached directory may have been removed since path was created */
+
+    if (errno != ENOENT || !dir_cache_flush(svc)) {
+        return -1;
+    }
+
+    return afs_create_path_directories(svc, name);
+}
+
+int afs_open_send_file(afs_service_t *svc, char *path, mode_t mode,
+                       int flags)
+{
+    struct stat st;
+    int fd;
+    int open_flags = O_WRONLY | O_CREAT | (flags & ~O_TRUNC);
+
+    /* File is written in place, truncation is deferred until file is
+     * known not to be shared through a hard link */
+
+#ifdef O_NOFOLLOW
+    open_flags |= O_NOFOLLOW;
+#endif
+
+    fd = open(path, open_flags, mode);
+    if (fd < 0 && afs_retry_path_directories(svc, path) == 0) {
+        fd = open(path, open_flags, mode);
+    }
+
+    if (fd < 0 && (errno == ELOOP || errno == ETXTBSY)) {
+        /* Symlink or running executable is replaced */
+        unlink(path);
+        fd = open(path, O_WRONLY | O_CREAT | flags, mode);
+    }
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_nlink > 1) {
+        close(fd);
+
+        if (!(flags & O_TRUNC)) {
+            /* Resumed content cannot be kept without writing through
+             * other links, file may be a store blob */
+            errno = EMLINK;
+            return -1;
+        }
+
+        unlink(path);
+        fd = open(path, O_WRONLY | O_CREAT | flags, mode);
+        if (fd < 0) {
+            return -1;
+        }
+
+        /* Created with umask applied */
+        st.st_mode = ~mode;
+    }
+    else if ((flags & O_TRUNC) && st.st_size > 0 && ftruncate(fd, 0)) {
+        close(fd);
+        return -1;
+    }
+
+    /* Pushed mode applies to existing files too */
+    if ((st.st_mode & 07777) != (mode & 07777) && fchmod(fd, mode)) {
+        adb_err("fchmod <%s> failed %d\n", path, errno);
+    }
+    return fd;
+}
+
+int afs_take_arg64(afs_service_t *svc, uint64_t *value)
+{
+    uint32_t arg[2];
+
+    if (svc->namelen < sizeof(arg)) {
+        return -1;
+    }
+
+    memcpy(arg, svc->buff, sizeof(arg));
+    *value = ltohl(arg[0]) | ((uint64_t)ltohl(arg[1]) << 32);
+
+    svc->namelen -= sizeof(arg);
+    if (svc->buff_size == 0) {
+        /* Skip argument in frame */
+        svc->buff += sizeof(arg);
+        svc->frame_len -= sizeof(arg);
+        return 0;
+    }
+
+    /* Shift remaining request data, including null terminator */
+    memmove(svc->buff, svc->buff + sizeof(arg), svc->namelen + 1);
+    return 0;
+}
+
+unsigned int afs_reply_room(afs_service_t *svc, apacket *p)
+{
+    uint8_t *end = p->data + CONFIG_ADBD_PAYLOAD_SIZE;
+
+    if (svc->pending == NULL && svc->packet_len > 0) {
+        /* Replies must not overwrite requests left in this frame */
+        end = svc->packet_ptr;
+    }
+
+    if (svc->pending == NULL && svc->buff_size == 0 &&
+        (uint8_t*)svc->buff < end) {
+        /* Nor request data read in place */
+        end = (uint8_t*)svc->buff;
+    }
+
+    return end - (p->data + p->write_len);
+}
+
+union syncmsg *afs_reserve_reply(afs_service_t *svc, apacket *p,
+                                unsigned int size)
+{
+    if (afs_reply_room(svc, p) < size &&
+        svc->pending == NULL && svc->buff_size == 0) {
+        /* Move request data read in place out of the way */
+        if (buff_detach(svc)) {
+            return NULL;
+        }
+    }
+
+    if (afs_reply_room(svc, p) < size &&
+        svc->pending == NULL && svc->packet_len > 0) {
+        /* Move requests left in frame out of the way */
+        if (stash_requests(svc)) {
+            return NULL;
+        }
+    }
+
+    if (afs_reply_room(svc, p) < size) {
+        return NULL;
+    }
+
+    return (union syncmsg*)(p->data + p->write_len);
+}
+
+int afs_prepare_fail_message(afs_service_t *svc, apacket *p, const char *reason)
+{
+    int len;
+    union syncmsg *msg;
+
+    adb_err("sync: failure: %s\n", reason);
+
+    len = strlen(reason);
+    msg = afs_reserve_reply(svc, p, sizeof(msg->data) + len);
+    if (msg == NULL) {
+        /* Truncate reason to fit in frame */
+        msg = afs_reserve_reply(svc, p, sizeof(msg->data));
+        if (msg == NULL) {
+            return -1;
+        }
+        len = afs_reply_room(svc, p) - sizeof(msg->data);
+    }
+
+    memcpy((char*)(&msg->data+1), reason, len);
+
+    msg->data.id = ID_FAIL;
+    msg->data.size = htoll(len);
+
+    p->write_len += sizeof(msg->data) + len;
+    return 0;
+}
+
+int afs_prepare_fail_errno(afs_service_t *svc, apacket *p)
+{
+    return afs_prepare_fail_message(svc, p, strerror(errno));
+}
+
+int afs_prepare_okay_message(afs_service_t *svc, apacket *p)
+{
+    union syncmsg *msg = afs_reserve_reply(svc, p, sizeof(msg->status));
+
+    if (msg == NULL) {
+        return -1;
+    }
+
+    msg->status.id = ID_OKAY;
+    msg->status.msglen = 0;
+    p->write_len += sizeof(msg->status);
+    return 0;
+}
+
+int afs_queue_work(afs_service_t *svc,
+                   void (*work_cb)(afs_service_t *svc),
+                   int (*work_reply_cb)(afs_service_t *svc, apacket *p))
+{
+    int ret;
+
+    /* Frame is released if service is closed while work is in progress */
+    if (buff_detach(svc)) {
+        return -1;
+    }
+
+    svc->work_cb = work_cb;
+    svc->work_reply_cb = work_reply_cb;
+
+    ret = adb_hal_queue_work(svc->client, file_sync_work,
+                             file_sync_after_work, svc);
+    if (ret) {
+        adb_err("failed to queue work %d\n", ret);
+        return -1;
+    }
+
+    svc->work_state = svc->state;
+    svc->state = AFS_STATE_WAIT_WORK;
+    return AFS_PROCESS_ASYNC;
+}
+
+void afs_resume_stream(afs_service_t *svc, apacket *p)
+{
+    int ret;
+
+    ret = file_sync_on_ack(&svc->service, p);
+    if (ret < 0) {
+        adb_service_close(svc->client, &svc->service, p);
+        return;
+    }
+
+    if (ret > 0) {
+        /* Frame kept again or already sent */
+        return;
+    }
+
+    if (p->write_len == 0) {
+        adb_hal_apacket_release(svc->client, p);
+        return;
+    }
+
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(svc->client, p);
+}
@@ -24,6 +24,6 @@
  * Public Function Prototypes
  ****************************************************************************/
 
-adb_service_t* file_sync_service(const char *params);
+adb_service_t* file_sync_service(adb_client_t *client, const char *params);
 
 #endif
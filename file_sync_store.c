@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* Blobs are named after their content hash in store directory */
+
+#define STORE_BLOB_PATH_SIZE (sizeof(CONFIG_ADBD_FILE_STORE_PATH) + 17)
+
+typedef struct afs_store_entry_s {
+    uint64_t hash;
+    off_t size;
+    time_t last_used;
+} afs_store_entry_t;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Store index, shared by all sessions. Only accessed from adb thread. */
+
+static afs_store_entry_t *g_store_entries;
+static unsigned g_store_count;
+static unsigned g_store_alloc;
+static off_t g_store_size;
+static bool g_store_loaded;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void store_blob_path(char *path, uint64_t hash)
+{
+    snprintf(path, STORE_BLOB_PATH_SIZE, "%s/%016llx",
+             CONFIG_ADBD_FILE_STORE_PATH, (unsigned long long)hash);
+}
+
+static afs_store_entry_t *store_add(uint64_t hash, off_t size,
+                                    time_t last_used)
+{
+    afs_store_entry_t *entry;
+
+    if (g_store_count == g_store_alloc) {
+        unsigned alloc = g_store_alloc ? 2 * g_store_alloc : 16;
+        entry = (afs_store_entry_t*)realloc(g_store_entries,
+                                            alloc * sizeof(*entry));
+        if (entry == NULL) {
+            return NULL;
+        }
+        g_store_entries = entry;
+        g_store_alloc = alloc;
+    }
+
+    entry = &g_store_entries[g_store_count++];
+    entry->hash = hash;
+    entry->size = size;
+    entry->last_used = last_used;
+    g_store_size += size;
+    return entry;
+}
+
+static void store_remove(afs_store_entry_t *entry)
+{
+    char path[STORE_BLOB_PATH_SIZE];
+
+    store_blob_path(path, entry->hash);
+    unlink(path);
+
+    g_store_size -= entry->size;
+    *entry = g_store_entries[--g_store_count];
+}
+
+static void store_load(void)
+{
+    DIR *d;
+    char *end;
+    uint64_t hash;
+    struct dirent *de;
+    struct stat st;
+    char path[STORE_BLOB_PATH_SIZE];
+
+    g_store_loaded = true;
+
+    if (mkdir(CONFIG_ADBD_FILE_STORE_PATH, 0700) && errno != EEXIST) {
+        adb_err("cannot create store %d\n", errno);
+        return;
+    }
+
+    d = opendir(CONFIG_ADBD_FILE_STORE_PATH);
+    if (d == NULL) {
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (strlen(de->d_name) != 16) {
+            continue;
+        }
+
+        hash = strtoull(de->d_name, &end, 16);
+        if (*end != 0) {
+            continue;
+        }
+
+        store_blob_path(path, hash);
+        if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        /* Access time keeps track of blob usage across restarts */
+        if (store_add(hash, st.st_size, st.st_atime) == NULL) {
+            break;
+        }
+    }
+
+    closedir(d);
+}
+
+static afs_store_entry_t *store_lookup(uint64_t hash)
+{
+    unsigned i;
+
+    if (!g_store_loaded) {
+        store_load();
+    }
+
+    for (i = 0; i < g_store_count; i++) {
+        if (g_store_entries[i].hash == hash) {
+            return &g_store_entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void store_evict(off_t size)
+{
+    unsigned i;
+    afs_store_entry_t *lru;
+
+    while (g_store_count > 0 &&
+           g_store_size + size > CONFIG_ADBD_FILE_STORE_SIZE) {
+        lru = &g_store_entries[0];
+        for (i = 1; i < g_store_count; i++) {
+            if (g_store_entries[i].last_used < lru->last_used) {
+                lru = &g_store_entries[i];
+            }
+        }
+        store_remove(lru);
+    }
+}
+
+static void store_touch(afs_store_entry_t *entry, const char *path)
+{
+    /* Only update access time, modification time may be shared with
+     * linked files */
+
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_NOW },
+        { .tv_nsec = UTIME_OMIT }
+    };
+
+    utimensat(AT_FDCWD, path, times, 0);
+    entry->last_used = time(NULL);
+}
+
+static int store_clone(const char *blob, const char *path, mode_t mode,
+                       afs_store_entry_t *entry)
+{
+    int src;
+    int dst;
+    int ret = -1;
+    struct stat st;
+
+    src = open(blob, O_RDONLY);
+    if (src < 0) {
+        return -1;
+    }
+
+    if (fstat(src, &st) || st.st_size != entry->size) {
+        /* Blob was modified, drop it */
+        adb_err("store blob %s modified\n", blob);
+        store_remove(entry);
+        goto exit_close_src;
+    }
+
+    unlink(path);
+
+#ifdef FICLONE
+    dst = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (dst < 0) {
+        goto exit_close_src;
+    }
+
+    ret = ioctl(dst, FICLONE, src);
+    close(dst);
+    if (ret == 0) {
+        goto exit_close_src;
+    }
+    unlink(path);
+#endif
+
+    /* Reflink not supported by filesystem. Hard link blob if it has
+     * requested permissions. Sync service never writes through it. */
+
+    if ((st.st_mode & 0777) == mode) {
+        ret = link(blob, path);
+    }
+
+exit_close_src:
+    close(src);
+    return ret;
+}
+
+static int prepare_miss_message(afs_service_t *svc, apacket *p)
+{
+    union syncmsg *msg = afs_reserve_reply(svc, p, sizeof(msg->status));
+
+    if (msg == NULL) {
+        return -1;
+    }
+
+    /* Expect file content in next SEND request */
+    svc->store_offer = 1;
+
+    msg->status.id = ID_MISS;
+    msg->status.msglen = 0;
+    p->write_len += sizeof(msg->status);
+    return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_store_place(afs_service_t *svc, apacket *p, bool is_link,
+                    mode_t mode)
+{
+    afs_store_entry_t *entry;
+    char blob[STORE_BLOB_PATH_SIZE];
+
+    entry = store_lookup(svc->store_hash);
+    if (entry == NULL || is_link) {
+        return prepare_miss_message(svc, p);
+    }
+
+    store_blob_path(blob, entry->hash);
+    if (store_clone(blob, svc->buff, mode, entry)) {
+        return prepare_miss_message(svc, p);
+    }
+
+    store_touch(entry, blob);
+    return afs_prepare_okay_message(svc, p);
+}
+
+void afs_store_begin(afs_service_t *svc)
+{
+    svc->send_file.store_path = NULL;
+
+    if (!svc->store_offer) {
+        return;
+    }
+    svc->store_offer = 0;
+
+    /* Hash content while it is written, blob is added once complete */
+
+    svc->send_file.store_path = strdup(svc->buff);
+    afs_xxh64_init(&svc->send_file.store_xxh);
+}
+
+void afs_store_commit(afs_service_t *svc)
+{
+    off_t size;
+    afs_store_entry_t *entry;
+    char blob[STORE_BLOB_PATH_SIZE];
+
+    if (svc->send_file.store_path == NULL) {
+        return;
+    }
+
+    if (afs_xxh64_digest(&svc->send_file.store_xxh) != svc->store_hash) {
+        adb_err("store hash mismatch for %s\n", svc->send_file.store_path);
+        return;
+    }
+
+    size = svc->send_file.store_xxh.total_len;
+    if (size > CONFIG_ADBD_FILE_STORE_SIZE ||
+        store_lookup(svc->store_hash) != NULL) {
+        return;
+    }
+
+    store_evict(size);
+    store_blob_path(blob, svc->store_hash);
+
+    if (link(svc->send_file.store_path, blob) && errno != EEXIST) {
+        adb_err("cannot add %s to store %d\n",
+            svc->send_file.store_path, errno);
+        return;
+    }
+
+    entry = store_add(svc->store_hash, size, time(NULL));
+    if (entry == NULL) {
+        unlink(blob);
+    }
+}
@@ -0,0 +1,742 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* Tree archive is carried in DATA messages and terminated by DONE, like
+ * RECV and SEND file content. Each entry is:
+ *
+ *   header   mode, mtime, size (lo, hi), namelen
+ *   name     path relative to tree root, "." for root itself
+ *   content  size bytes: file data or symlink target
+ *
+ * A header with mode 0 ends the archive. Directories follow their
+ * content so their mtime is applied last.
+ *
+ * On pull, entries that cannot be read are left out and the archive is
+ * followed by FAIL instead of DONE. A read error on announced content
+ * aborts the archive with FAIL. */
+
+typedef struct afs_tree_hdr_s {
+    unsigned mode;
+    unsigned mtime;
+    unsigned size[2];
+    unsigned namelen;
+} afs_tree_hdr_t;
+
+#define TREE_BUFF_SIZE (sizeof(afs_tree_hdr_t) + 2 * PATH_MAX)
+
+typedef struct afs_tree_s {
+    /* Tree root followed by current entry */
+    char *path;
+    unsigned root_len;
+
+    /* Current entry header, name and symlink target */
+    uint8_t buf[TREE_BUFF_SIZE];
+    unsigned buf_len;
+    unsigned buf_pos;
+
+    /* Current file content */
+    int fd;
+    uint64_t remaining;
+    unsigned mtime;
+
+    uint8_t done;
+    int error;
+
+    /* Directories being walked (pull only) */
+    unsigned depth;
+    DIR *dirs[CONFIG_ADBD_FILE_TREE_DEPTH];
+    unsigned dir_len[CONFIG_ADBD_FILE_TREE_DEPTH];
+
+    /* Entries left out of archive (pull only), first one is reported */
+    unsigned skipped;
+    char *skip_msg;
+} afs_tree_t;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static afs_tree_t *tree_create(afs_service_t *svc)
+{
+    unsigned len;
+    afs_tree_t *t;
+
+    len = strlen(svc->buff);
+    while (len > 1 && svc->buff[len-1] == '/') {
+        len--;
+    }
+
+    if (svc->buff[0] != '/' || len >= PATH_MAX - 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    t = (afs_tree_t*)malloc(sizeof(afs_tree_t));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->path = (char*)malloc(PATH_MAX);
+    if (t->path == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    /* Root "/" has empty prefix */
+    t->root_len = len > 1 ? len : 0;
+    memcpy(t->path, svc->buff, t->root_len);
+    t->path[t->root_len] = 0;
+
+    t->buf_len = 0;
+    t->buf_pos = 0;
+    t->fd = -1;
+    t->remaining = 0;
+    t->done = 0;
+    t->error = 0;
+    t->depth = 0;
+    t->skipped = 0;
+    t->skip_msg = NULL;
+
+    svc->tree.ctx = t;
+    return t;
+}
+
+static const char *tree_path(afs_tree_t *t)
+{
+    return t->path[0] ? t->path : "/";
+}
+
+/* Pull */
+
+static void tree_stage_entry(afs_tree_t *t, struct stat *st, unsigned len,
+                             uint64_t size)
+{
+    afs_tree_hdr_t *hdr = (afs_tree_hdr_t*)t->buf;
+    unsigned namelen;
+
+    if (len <= t->root_len) {
+        namelen = 1;
+        t->buf[sizeof(*hdr)] = '.';
+    }
+    else {
+        namelen = len - t->root_len - 1;
+        memcpy(t->buf + sizeof(*hdr), t->path + t->root_len + 1, namelen);
+    }
+
+    hdr->mode = htoll(st->st_mode);
+    hdr->mtime = htoll(st->st_mtime);
+    hdr->size[0] = htoll((uint32_t)size);
+    hdr->size[1] = htoll((uint32_t)(size >> 32));
+    hdr->namelen = htoll(namelen);
+
+    t->buf_len = sizeof(*hdr) + namelen;
+    t->buf_pos = 0;
+}
+
+static void tree_stage_end(afs_tree_t *t)
+{
+    memset(t->buf, 0, sizeof(afs_tree_hdr_t));
+    t->buf_len = sizeof(afs_tree_hdr_t);
+    t->buf_pos = 0;
+    t->done = 1;
+}
+
+static void tree_skip_entry(afs_tree_t *t, const char *reason)
+{
+    unsigned len;
+
+    adb_err("tree entry <%s> skipped: %s\n", tree_path(t), reason);
+
+    if (t->skipped++ > 0) {
+        return;
+    }
+
+    len = strlen(tree_path(t)) + strlen(reason) + 3;
+    t->skip_msg = (char*)malloc(len);
+    if (t->skip_msg != NULL) {
+        snprintf(t->skip_msg, len, "%s: %s", tree_path(t), reason);
+    }
+}
+
+static void tree_next_entry(afs_tree_t *t)
+{
+    int fd;
+    DIR *d;
+    unsigned len;
+    unsigned namelen;
+    ssize_t target_len;
+    struct stat st;
+    struct dirent *de;
+
+    while (t->depth > 0) {
+        len = t->dir_len[t->depth-1];
+        t->path[len] = 0;
+
+        de = readdir(t->dirs[t->depth-1]);
+        if (de == NULL) {
+            closedir(t->dirs[--t->depth]);
+
+            if (lstat(tree_path(t), &st) == 0) {
+                tree_stage_entry(t, &st, len, 0);
+                return;
+            }
+            tree_skip_entry(t, strerror(errno));
+            continue;
+        }
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+
+        namelen = strlen(de->d_name);
+        if (len + 1 + namelen >= PATH_MAX) {
+            tree_skip_entry(t, strerror(ENAMETOOLONG));
+            continue;
+        }
+
+        t->path[len] = '/';
+        memcpy(t->path + len + 1, de->d_name, namelen + 1);
+        len += 1 + namelen;
+
+        if (lstat(t->path, &st)) {
+            tree_skip_entry(t, strerror(errno));
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (t->depth >= CONFIG_ADBD_FILE_TREE_DEPTH) {
+                tree_skip_entry(t, "tree too deep");
+                continue;
+            }
+            d = opendir(t->path);
+            if (d == NULL) {
+                tree_skip_entry(t, strerror(errno));
+                continue;
+            }
+            t->dirs[t->depth] = d;
+            t->dir_len[t->depth++] = len;
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            fd = open(t->path, O_RDONLY);
+            if (fd < 0) {
+                tree_skip_entry(t, strerror(errno));
+                continue;
+            }
+            if (st.st_size > 0) {
+                t->fd = fd;
+            }
+            else {
+                /* No content to read */
+                close(fd);
+            }
+            t->remaining = st.st_size;
+            tree_stage_entry(t, &st, len, st.st_size);
+            return;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+            tree_stage_entry(t, &st, len, 0);
+            target_len = readlink(t->path, (char*)t->buf + t->buf_len,
+                                  PATH_MAX);
+            if (target_len < 0) {
+                tree_skip_entry(t, strerror(errno));
+                continue;
+            }
+            ((afs_tree_hdr_t*)t->buf)->size[0] = htoll(target_len);
+            t->buf_len += target_len;
+            return;
+        }
+
+        /* Other file types are not transferred */
+    }
+
+    tree_stage_end(t);
+}
+
+static unsigned tree_fill(afs_tree_t *t, uint8_t *out, unsigned size)
+{
+    ssize_t ret;
+    unsigned len = 0;
+    unsigned chunk;
+
+    while (len < size && t->error == 0) {
+        if (t->buf_pos < t->buf_len) {
+            chunk = min(size - len, t->buf_len - t->buf_pos);
+            memcpy(out + len, t->buf + t->buf_pos, chunk);
+            t->buf_pos += chunk;
+            len += chunk;
+            continue;
+        }
+
+        if (t->fd >= 0) {
+            chunk = min(size - len, t->remaining);
+            ret = read(t->fd, out + len, chunk);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                /* Announced content cannot be sent, archive is aborted.
+                 * File may have shrunk since header was sent. */
+                t->error = ret < 0 ? errno : EIO;
+                adb_err("tree read <%s> failed %d\n", tree_path(t), t->error);
+                break;
+            }
+
+            len += ret;
+            t->remaining -= ret;
+            if (t->remaining == 0) {
+                close(t->fd);
+                t->fd = -1;
+            }
+            continue;
+        }
+
+        if (t->done) {
+            break;
+        }
+
+        tree_next_entry(t);
+    }
+
+    return len;
+}
+
+/* Push */
+
+static int tree_check_name(const char *name, unsigned len)
+{
+    unsigned i;
+    unsigned start = 0;
+
+    if (len == 0 || name[0] == '/' || memchr(name, 0, len)) {
+        return -1;
+    }
+
+    /* Reject ".." components */
+    for (i = 0; i <= len; i++) {
+        if (i == len || name[i] == '/') {
+            if (i - start == 2 && name[start] == '.' && name[start+1] == '.') {
+                return -1;
+            }
+            start = i + 1;
+        }
+    }
+    return 0;
+}
+
+static void tree_set_error(afs_tree_t *t, int error)
+{
+    adb_err("tree entry <%s> failed %d\n", tree_path(t), error);
+    if (t->error == 0) {
+        t->error = error;
+    }
+}
+
+static void tree_close_file(afs_tree_t *t)
+{
+    struct timespec times[2];
+
+    if (t->fd < 0) {
+        return;
+    }
+
+    times[0].tv_sec = t->mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    futimens(t->fd, times);
+
+    close(t->fd);
+    t->fd = -1;
+}
+
+static void tree_apply_entry(afs_service_t *svc, afs_tree_t *t)
+{
+    afs_tree_hdr_t *hdr = (afs_tree_hdr_t*)t->buf;
+    const char *name = (const char*)(hdr + 1);
+    unsigned namelen = ltohl(hdr->namelen);
+    mode_t mode = ltohl(hdr->mode);
+    uint64_t size = ltohl(hdr->size[0]) |
+                    ((uint64_t)ltohl(hdr->size[1]) << 32);
+    struct timespec times[2];
+    char *target;
+    int ret;
+
+    t->mtime = ltohl(hdr->mtime);
+    times[0].tv_sec = t->mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+
+    if (!S_ISLNK(mode)) {
+        /* File content follows entry */
+        t->remaining = size;
+    }
+
+    /* Build destination path */
+    t->path[t->root_len] = 0;
+    if (namelen != 1 || name[0] != '.') {
+        if (tree_check_name(name, namelen) ||
+            t->root_len + 1 + namelen >= PATH_MAX) {
+            tree_set_error(t, EINVAL);
+            return;
+        }
+        t->path[t->root_len] = '/';
+        memcpy(t->path + t->root_len + 1, name, namelen);
+        t->path[t->root_len + 1 + namelen] = 0;
+    }
+
+    if (t->path[0] && afs_create_path_directories(svc, t->path)) {
+        tree_set_error(t, errno);
+        return;
+    }
+
+    if (S_ISDIR(mode)) {
+        ret = mkdir(tree_path(t), 0775);
+        if (ret && afs_retry_path_directories(svc, t->path) == 0) {
+            ret = mkdir(tree_path(t), 0775);
+        }
+        if (ret && errno != EEXIST) {
+            tree_set_error(t, errno);
+            return;
+        }
+        chmod(tree_path(t), mode & 07777);
+        utimensat(AT_FDCWD, tree_path(t), times, 0);
+        return;
+    }
+
+    if (S_ISREG(mode)) {
+        t->fd = afs_open_send_file(svc, t->path, mode & 0777, O_TRUNC);
+        if (t->fd < 0) {
+            tree_set_error(t, errno);
+            return;
+        }
+        if (t->remaining == 0) {
+            tree_close_file(t);
+        }
+        return;
+    }
+
+    if (S_ISLNK(mode)) {
+        /* Target follows name in entry buffer */
+        target = (char*)t->buf + sizeof(*hdr) + namelen;
+        target[size] = 0;
+
+        unlink(t->path);
+        ret = symlink(target, t->path);
+        if (ret && afs_retry_path_directories(svc, t->path) == 0) {
+            ret = symlink(target, t->path);
+        }
+        if (ret) {
+            tree_set_error(t, errno);
+            return;
+        }
+        utimensat(AT_FDCWD, t->path, times, AT_SYMLINK_NOFOLLOW);
+        return;
+    }
+
+    tree_set_error(t, EINVAL);
+}
+
+static uint64_t tree_entry_size(afs_tree_hdr_t *hdr)
+{
+    uint64_t size = sizeof(*hdr) + (uint64_t)ltohl(hdr->namelen);
+
+    if (S_ISLNK(ltohl(hdr->mode))) {
+        size += ltohl(hdr->size[0]) | ((uint64_t)ltohl(hdr->size[1]) << 32);
+    }
+    return size;
+}
+
+static void tree_consume(afs_service_t *svc, afs_tree_t *t,
+                         const uint8_t *data, unsigned len)
+{
+    ssize_t ret;
+    unsigned chunk;
+    unsigned expected;
+    afs_tree_hdr_t *hdr = (afs_tree_hdr_t*)t->buf;
+
+    while (len > 0) {
+        if (t->remaining > 0) {
+            /* File content, dropped if file could not be created */
+            chunk = min(len, t->remaining);
+            if (t->fd >= 0) {
+                ret = write(t->fd, data, chunk);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    tree_set_error(t, ret < 0 ? errno : EIO);
+                    close(t->fd);
+                    t->fd = -1;
+                    ret = chunk;
+                }
+                chunk = ret;
+            }
+
+            data += chunk;
+            len -= chunk;
+            t->remaining -= chunk;
+            if (t->remaining == 0) {
+                tree_close_file(t);
+            }
+            continue;
+        }
+
+        if (t->done) {
+            /* Data after end of archive */
+            if (t->error == 0) {
+                t->error = EINVAL;
+            }
+            return;
+        }
+
+        if (t->buf_len < sizeof(*hdr)) {
+            chunk = min(len, sizeof(*hdr) - t->buf_len);
+            memcpy(t->buf + t->buf_len, data, chunk);
+            t->buf_len += chunk;
+            data += chunk;
+            len -= chunk;
+
+            if (t->buf_len < sizeof(*hdr)) {
+                continue;
+            }
+
+            if (hdr->mode == 0) {
+                t->done = 1;
+                continue;
+            }
+
+            /* Keep room for symlink target terminator */
+            if (tree_entry_size(hdr) >= TREE_BUFF_SIZE) {
+                /* Archive cannot be parsed further */
+                tree_set_error(t, ENAMETOOLONG);
+                t->done = 1;
+                continue;
+            }
+        }
+
+        /* Entry name and symlink target */
+        expected = tree_entry_size(hdr);
+        chunk = min(len, expected - t->buf_len);
+        memcpy(t->buf + t->buf_len, data, chunk);
+        t->buf_len += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if (t->buf_len == expected) {
+            tree_apply_entry(svc, t);
+            t->buf_len = 0;
+        }
+    }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_state_init_tree_recv(afs_service_t *svc, apacket *p)
+{
+    DIR *d;
+    afs_tree_t *t;
+
+    d = opendir(svc->buff);
+    if (d == NULL) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    t = tree_create(svc);
+    if (t == NULL) {
+        closedir(d);
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    t->dirs[0] = d;
+    t->dir_len[0] = t->root_len;
+    t->depth = 1;
+
+    svc->state = AFS_STATE_PROCESS_TREE_RECV;
+    return afs_state_process_tree_recv(svc, p);
+}
+
+int afs_state_process_tree_recv(afs_service_t *svc, apacket *p)
+{
+    unsigned len;
+    const char *reason = NULL;
+    union syncmsg *msg;
+    afs_tree_t *t = svc->tree.ctx;
+
+    if (CONFIG_ADBD_PAYLOAD_SIZE - p->write_len <= sizeof(msg->data)) {
+        /* Continue in next frame */
+        return 1;
+    }
+
+    msg = afs_reserve_reply(svc, p, CONFIG_ADBD_PAYLOAD_SIZE - p->write_len);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    len = tree_fill(t, (uint8_t*)((&msg->data)+1),
+        CONFIG_ADBD_PAYLOAD_SIZE - sizeof(msg->data) - p->write_len);
+
+    if (len > 0) {
+        msg->data.id = ID_DATA;
+        msg->data.size = htoll(len);
+        p->write_len += sizeof(msg->data) + len;
+    }
+
+    if (t->error) {
+        /* Archive aborted while sending content of current entry */
+        snprintf((char*)t->buf, sizeof(t->buf), "%s: %s",
+                 tree_path(t), strerror(t->error));
+        reason = (char*)t->buf;
+    }
+    else if (!t->done || t->buf_pos < t->buf_len) {
+        return 1;
+    }
+    else if (t->skipped > 0) {
+        /* Archive is complete but some entries were left out */
+        snprintf((char*)t->buf, sizeof(t->buf), "%u entries skipped, %s",
+                 t->skipped, t->skip_msg ? t->skip_msg : "");
+        reason = (char*)t->buf;
+    }
+
+    if (reason != NULL) {
+        if (p->write_len > 0 && CONFIG_ADBD_PAYLOAD_SIZE - p->write_len <
+            sizeof(msg->data) + strlen(reason)) {
+            /* Send reason in next frame */
+            return 1;
+        }
+        return afs_prepare_fail_message(svc, p, reason);
+    }
+
+    if (CONFIG_ADBD_PAYLOAD_SIZE - p->write_len < sizeof(msg->status)) {
+        return 1;
+    }
+
+    msg = (union syncmsg*)(p->data + p->write_len);
+    msg->status.id = ID_DONE;
+    msg->status.msglen = 0;
+    p->write_len += sizeof(msg->status);
+    return 0;
+}
+
+int afs_state_init_tree_send(afs_service_t *svc, apacket *p)
+{
+    afs_tree_t *t;
+
+    t = tree_create(svc);
+    if (t == NULL) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    svc->state = AFS_STATE_PROCESS_TREE_SEND_HDR;
+    return 1;
+}
+
+int afs_state_process_tree_send_header(afs_service_t *svc, apacket *p)
+{
+    int ret;
+    afs_tree_t *t = svc->tree.ctx;
+    union syncmsg *msg;
+
+    ret = afs_read_from_packet(svc, sizeof(msg->data));
+    if (ret != 0) {
+        if (ret == -EAGAIN) {
+            return 1;
+        }
+        return afs_prepare_fail_message(svc, p, "read error");
+    }
+
+    msg = (union syncmsg*)svc->buff;
+
+    if (msg->data.id == ID_DATA) {
+        svc->namelen = ltohl(msg->data.size);
+        svc->state = AFS_STATE_PROCESS_TREE_SEND_DATA;
+        return 1;
+    }
+
+    if (msg->data.id != ID_DONE) {
+        adb_log("Data message is 0x%x\n", msg->data.id);
+        return afs_prepare_fail_message(svc, p, "invalid data message");
+    }
+
+    tree_close_file(t);
+    if (t->error == 0 && !t->done) {
+        return afs_prepare_fail_message(svc, p, "truncated archive");
+    }
+
+    if (t->error) {
+        errno = t->error;
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    return afs_prepare_okay_message(svc, p);
+}
+
+int afs_state_process_tree_send_data(afs_service_t *svc, apacket *p)
+{
+    unsigned len = min(svc->packet_len, svc->namelen);
+
+    UNUSED(p);
+
+    tree_consume(svc, svc->tree.ctx, svc->packet_ptr, len);
+
+    svc->namelen -= len;
+    svc->packet_len -= len;
+    svc->packet_ptr += len;
+
+    if (svc->namelen == 0) {
+        svc->state = AFS_STATE_PROCESS_TREE_SEND_HDR;
+    }
+    return 1;
+}
+
+void afs_tree_reset(afs_service_t *svc)
+{
+    afs_tree_t *t = svc->tree.ctx;
+
+    while (t->depth > 0) {
+        closedir(t->dirs[--t->depth]);
+    }
+
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+
+    free(t->skip_msg);
+    free(t->path);
+    free(t);
+}
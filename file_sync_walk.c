@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+
+#include "adb.h"
+#include "file_sync_priv.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* WALK <max depth> <path>[\0<pattern>]
+ *
+ * Replies one WENT message per entry of the subtree, followed by name
+ * relative to path, and a final DONE message of the same size. Entries
+ * are packed in frames and may span several frames. Directories are
+ * reported before their content and only walked up to max depth if not
+ * zero. If pattern is set, only entries whose name matches it are
+ * reported, all directories are still walked.
+ *
+ * An entry that cannot be read, or a directory that cannot be walked, is
+ * reported by a WENT message with mode 0 and errno in size. DONE size is
+ * the number of such messages, so a walk with errors does not end clean. */
+
+typedef struct afs_walk_ent_s {
+    unsigned id;
+    unsigned mode;
+    unsigned size[2];
+    unsigned mtime;
+    unsigned namelen;
+} afs_walk_ent_t;
+
+typedef struct afs_walk_s {
+    /* Walk root followed by current entry */
+    char path[PATH_MAX];
+    unsigned root_len;
+
+    char *pattern;
+    unsigned max_depth;
+
+    /* Current entry message and name */
+    uint8_t buf[sizeof(afs_walk_ent_t) + PATH_MAX];
+    unsigned buf_len;
+    unsigned buf_pos;
+    uint8_t done;
+
+    /* Directory just reported that cannot be walked, and error count */
+    int error;
+    unsigned error_len;
+    unsigned errors;
+
+    /* Directories being walked */
+    unsigned depth;
+    DIR *dirs[CONFIG_ADBD_FILE_WALK_DEPTH];
+    unsigned dir_len[CONFIG_ADBD_FILE_WALK_DEPTH];
+} afs_walk_t;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void walk_stage_entry(afs_walk_t *w, struct stat *st, unsigned len)
+{
+    afs_walk_ent_t *ent = (afs_walk_ent_t*)w->buf;
+    unsigned namelen = len - w->root_len - 1;
+
+    memcpy(w->buf + sizeof(*ent), w->path + w->root_len + 1, namelen);
+
+    ent->id = ID_WENT;
+    ent->mode = htoll(st->st_mode);
+    ent->size[0] = htoll((uint32_t)st->st_size);
+    ent->size[1] = htoll((uint32_t)((uint64_t)st->st_size >> 32));
+    ent->mtime = htoll(st->st_mtime);
+    ent->namelen = htoll(namelen);
+
+    w->buf_len = sizeof(*ent) + namelen;
+    w->buf_pos = 0;
+}
+
+static void walk_stage_error(afs_walk_t *w, unsigned len, const char *name,
+                             int error)
+{
+    afs_walk_ent_t *ent = (afs_walk_ent_t*)w->buf;
+    char *out = (char*)w->buf + sizeof(*ent);
+    unsigned namelen = 0;
+    unsigned chunk;
+
+    adb_err("walk entry <%.*s/%s> failed %d\n", len, w->path, name, error);
+
+    /* Name is entry directory followed by entry name, truncated if too
+     * long to be walked */
+    if (len > w->root_len) {
+        namelen = len - w->root_len - 1;
+        memcpy(out, w->path + w->root_len + 1, namelen);
+        out[namelen++] = '/';
+    }
+
+    chunk = min(strlen(name), PATH_MAX - namelen);
+    memcpy(out + namelen, name, chunk);
+    namelen += chunk;
+
+    memset(ent, 0, sizeof(*ent));
+    ent->id = ID_WENT;
+    ent->size[0] = htoll(error);
+    ent->namelen = htoll(namelen);
+
+    w->buf_len = sizeof(*ent) + namelen;
+    w->buf_pos = 0;
+    w->errors += 1;
+}
+
+static void walk_stage_end(afs_walk_t *w)
+{
+    afs_walk_ent_t *ent = (afs_walk_ent_t*)w->buf;
+
+    memset(ent, 0, sizeof(*ent));
+    ent->id = ID_DONE;
+    ent->size[0] = htoll(w->errors);
+
+    w->buf_len = sizeof(*ent);
+    w->buf_pos = 0;
+    w->done = 1;
+}
+
+static void walk_next_entry(afs_walk_t *w)
+{
+    DIR *d;
+    int error;
+    unsigned len;
+    unsigned namelen;
+    struct stat st;
+    struct dirent *de;
+
+    if (w->error) {
+        /* Directory reported last is still in path */
+        walk_stage_error(w, w->error_len, w->path + w->error_len + 1,
+                         w->error);
+        w->error = 0;
+        return;
+    }
+
+    while (w->depth > 0) {
+        len = w->dir_len[w->depth-1];
+
+        de = readdir(w->dirs[w->depth-1]);
+        if (de == NULL) {
+            closedir(w->dirs[--w->depth]);
+            continue;
+        }
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+
+        namelen = strlen(de->d_name);
+        if (len + 1 + namelen >= PATH_MAX) {
+            walk_stage_error(w, len, de->d_name, ENAMETOOLONG);
+            return;
+        }
+
+        w->path[len] = '/';
+        memcpy(w->path + len + 1, de->d_name, namelen + 1);
+
+        /* Do not follow symlinks */
+        if (lstat(w->path, &st)) {
+            walk_stage_error(w, len, de->d_name, errno);
+            return;
+        }
+
+        error = 0;
+        if (S_ISDIR(st.st_mode) &&
+            (w->max_depth == 0 || w->depth < w->max_depth)) {
+            if (w->depth >= CONFIG_ADBD_FILE_WALK_DEPTH) {
+                error = ELOOP;
+            }
+            else if ((d = opendir(w->path)) != NULL) {
+                w->dirs[w->depth] = d;
+                w->dir_len[w->depth++] = len + 1 + namelen;
+            }
+            else {
+                error = errno;
+            }
+        }
+
+        if (w->pattern && fnmatch(w->pattern, w->path + len + 1, 0)) {
+            if (error) {
+                /* Errors are reported whatever the pattern */
+                walk_stage_error(w, len, de->d_name, error);
+                return;
+            }
+            continue;
+        }
+
+        walk_stage_entry(w, &st, len + 1 + namelen);
+
+        /* Report error once directory entry is sent */
+        w->error = error;
+        w->error_len = len;
+        return;
+    }
+
+    walk_stage_end(w);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int afs_state_init_walk(afs_service_t *svc, apacket *p)
+{
+    unsigned len;
+    uint64_t max_depth;
+    afs_walk_t *w;
+
+    if (afs_take_arg64(svc, &max_depth)) {
+        return afs_prepare_fail_message(svc, p, "invalid depth");
+    }
+
+    len = strlen(svc->buff);
+    while (len > 1 && svc->buff[len-1] == '/') {
+        len--;
+    }
+
+    if (len == 0 || len >= PATH_MAX - 2) {
+        return afs_prepare_fail_message(svc, p, "invalid path");
+    }
+
+    w = (afs_walk_t*)malloc(sizeof(afs_walk_t));
+    if (w == NULL) {
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    /* Pattern follows path */
+    w->pattern = NULL;
+    if (strlen(svc->buff) + 1 < svc->namelen) {
+        w->pattern = strdup(svc->buff + strlen(svc->buff) + 1);
+        if (w->pattern == NULL) {
+            free(w);
+            return afs_prepare_fail_errno(svc, p);
+        }
+    }
+
+    /* Root "/" has empty prefix */
+    w->root_len = len > 1 ? len : 0;
+    memcpy(w->path, svc->buff, len);
+    w->path[len] = 0;
+
+    w->dirs[0] = opendir(w->path);
+    if (w->dirs[0] == NULL) {
+        free(w->pattern);
+        free(w);
+        return afs_prepare_fail_errno(svc, p);
+    }
+
+    w->dir_len[0] = w->root_len;
+    w->depth = 1;
+    w->max_depth = max_depth > UINT32_MAX ? 0 : max_depth;
+    w->buf_len = 0;
+    w->buf_pos = 0;
+    w->done = 0;
+    w->error = 0;
+    w->errors = 0;
+
+    svc->walk.ctx = w;
+    svc->state = AFS_STATE_PROCESS_WALK;
+    return afs_state_process_walk(svc, p);
+}
+
+int afs_state_process_walk(afs_service_t *svc, apacket *p)
+{
+    unsigned len;
+    unsigned size;
+    uint8_t *out;
+    afs_walk_t *w = svc->walk.ctx;
+
+    /* Use all space left in frame */
+
+    size = CONFIG_ADBD_PAYLOAD_SIZE - p->write_len;
+    out = (uint8_t*)afs_reserve_reply(svc, p, size);
+    if (out == NULL) {
+        return -1;
+    }
+
+    while (size > 0) {
+        if (w->buf_pos == w->buf_len) {
+            if (w->done) {
+                return 0;
+            }
+            walk_next_entry(w);
+        }
+
+        len = min(size, w->buf_len - w->buf_pos);
+        memcpy(out, w->buf + w->buf_pos, len);
+        w->buf_pos += len;
+        p->write_len += len;
+        out += len;
+        size -= len;
+    }
+
+    if (w->done && w->buf_pos == w->buf_len) {
+        return 0;
+    }
+
+    /* Continue in next frame */
+    return 1;
+}
+
+void afs_walk_reset(afs_service_t *svc)
+{
+    afs_walk_t *w = svc->walk.ctx;
+
+    while (w->depth > 0) {
+        closedir(w->dirs[--w->depth]);
+    }
+
+    free(w->pattern);
+    free(w);
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _DEFAULT_SOURCE 1 /* Force _DEFAULT_SOURCE (required for cfmakeraw) */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <termios.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif
+
+#include "adb.h"
+#include "hal_uv_priv.h"
+#include "dev_service.h"
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* Device is read and written on event loop like a tcp stream: one frame
+ * read at a time until host acknowledges it, host frames acknowledged
+ * once written to device. */
+
+typedef struct adev_service_s {
+    adb_service_t service;
+    adb_client_t *client;
+    uv_pipe_t pipe;
+    int wait_ack;
+    /* Writes to device not completed yet. Once closed, their frames
+     * belong to service and client must not be used anymore. */
+    unsigned write_pending;
+    uint8_t closed;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    /* Host data queued to device and already acknowledged */
+    size_t write_queued;
+#endif
+} adev_service_t;
+
+typedef struct adev_speed_s {
+    unsigned baud;
+    speed_t speed;
+} adev_speed_t;
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static speed_t dev_speed(unsigned long baud);
+static int dev_setup_tty(int fd, unsigned long baud);
+
+static void dev_alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf);
+static void dev_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                  const uv_buf_t* buf);
+static void dev_after_write(uv_write_t* req, int status);
+
+static int dev_write(adb_service_t *service, apacket *p);
+static int dev_ack(adb_service_t *service, apacket *p);
+static void dev_kick(adb_service_t *service);
+static void dev_close(adb_service_t *service);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const adev_speed_t g_dev_speeds[] = {
+    { 1200,    B1200    },
+    { 2400,    B2400    },
+    { 4800,    B4800    },
+    { 9600,    B9600    },
+    { 19200,   B19200   },
+    { 38400,   B38400   },
+    { 57600,   B57600   },
+    { 115200,  B115200  },
+#ifdef B230400
+    { 230400,  B230400  },
+#endif
+#ifdef B460800
+    { 460800,  B460800  },
+#endif
+#ifdef B921600
+    { 921600,  B921600  },
+#endif
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+    { 2000000, B2000000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+#ifdef B4000000
+    { 4000000, B4000000 },
+#endif
+};
+
+static const adb_service_ops_t dev_ops = {
+    .on_write_frame = dev_write,
+    .on_ack_frame   = dev_ack,
+    .on_kick        = dev_kick,
+    .on_close       = dev_close
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static speed_t dev_speed(unsigned long baud) {
+    size_t i;
+
+    for (i = 0; i < sizeof(g_dev_speeds) / sizeof(g_dev_speeds[0]); i++) {
+        if (g_dev_speeds[i].baud == baud) {
+            return g_dev_speeds[i].speed;
+        }
+    }
+
+    return B0;
+}
+
+static int dev_setup_tty(int fd, unsigned long baud) {
+    struct termios tio;
+    speed_t speed;
+
+    if (!isatty(fd)) {
+        /* Other character devices are used as is */
+        return 0;
+    }
+
+    if (tcgetattr(fd, &tio)) {
+        return -1;
+    }
+
+    /* No line discipline processing. Read returns as soon as a byte is
+     * received instead of waiting for more. */
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+
+    if (baud > 0) {
+        speed = dev_speed(baud);
+        if (speed == B0) {
+            adb_err("unsupported baud rate %lu\n", baud);
+            return -1;
+        }
+
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+
+    if (tcsetattr(fd, TCSANOW, &tio)) {
+        return -1;
+    }
+
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+    {
+        /* Best effort, UART driver pushes received bytes at once
+         * instead of deferring them. Not supported by all drivers. */
+
+        struct serial_struct serial;
+
+        if (!ioctl(fd, TIOCGSERIAL, &serial)) {
+            serial.flags |= ASYNC_LOW_LATENCY;
+            ioctl(fd, TIOCSSERIAL, &serial);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static void dev_alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf) {
+    adev_service_t *svc = container_of(handle, adev_service_t, pipe);
+    apacket_uv_t *ap;
+
+    UNUSED(len);
+
+    ap = adb_uv_packet_allocate((adb_client_uv_t*)svc->client, 0);
+    if (ap == NULL) {
+        buf->base = NULL;
+        buf->len = 0;
+        return;
+    }
+
+    buf->base = (char*)ap->p.data;
+    buf->len = CONFIG_ADBD_PAYLOAD_SIZE;
+}
+
+static void dev_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                  const uv_buf_t* buf) {
+    adev_service_t *svc = container_of(stream, adev_service_t, pipe);
+    apacket_uv_t *ap;
+
+    if (nread == UV_ENOBUFS) {
+        /* No frame available, resumed on next kick */
+        uv_read_stop(stream);
+        return;
+    }
+
+    ap = container_of(buf->base, apacket_uv_t, p.data);
+
+    if (nread == 0) {
+        adb_hal_apacket_release(svc->client, &ap->p);
+        return;
+    }
+
+    if (nread < 0) {
+        /* Device removed or pty hung up */
+        adb_err("device read failed %d\n", nread);
+        adb_service_close(svc->client, &svc->service, &ap->p);
+        return;
+    }
+
+    /* Wait for ACK before reading next frame from device */
+
+    svc->wait_ack = 1;
+    uv_read_stop(stream);
+
+    ap->p.write_len = nread;
+    ap->p.msg.arg0 = svc->service.id;
+    ap->p.msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(svc->client, &ap->p);
+}
+
+static void dev_after_write(uv_write_t* req, int status) {
+    apacket_uv_t *up = container_of(req, apacket_uv_t, wr);
+    adev_service_t *svc = (adev_service_t*)req->data;
+
+    svc->write_pending -= 1;
+    if (svc->closed) {
+        /* Write cancelled by close, client may be gone already */
+        free(up);
+        return;
+    }
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (up->p.write_len > 0) {
+        /* Frame was acknowledged once queued */
+        svc->write_queued -= up->p.write_len;
+        up->p.write_len = 0;
+
+        if (status < 0) {
+            adb_service_close(svc->client, &svc->service, &up->p);
+        }
+        else {
+            adb_hal_apacket_release(svc->client, &up->p);
+        }
+        return;
+    }
+#endif
+
+    if (status < 0) {
+        adb_err("device write failed %d\n", status);
+        adb_service_close(svc->client, &svc->service, &up->p);
+        return;
+    }
+
+    adb_send_okay_frame(svc->client, &up->p,
+        svc->service.id, svc->service.peer_id);
+}
+
+static int dev_write(adb_service_t *service, apacket *p) {
+    adev_service_t *svc = container_of(service, adev_service_t, service);
+    apacket_uv_t *up = container_of(p, apacket_uv_t, p);
+    uv_buf_t buf;
+    int ret;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    apacket *okay = NULL;
+
+    /* Acknowledge now so that host sends next frame while this one is
+     * written. Otherwise ack is deferred until write is done. */
+
+    p->write_len = 0;
+    if (svc->write_queued + p->msg.data_length <= CONFIG_ADBD_WRITE_BUDGET) {
+        okay = adb_hal_apacket_allocate(svc->client);
+        if (okay != NULL) {
+            p->write_len = p->msg.data_length;
+        }
+    }
+#endif
+
+    buf = uv_buf_init((char*)p->data, p->msg.data_length);
+    up->wr.data = svc;
+
+    ret = uv_write(&up->wr, (uv_stream_t*)&svc->pipe, &buf, 1,
+                   dev_after_write);
+    if (ret) {
+        adb_err("uv_write failed %d\n", ret);
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+        if (okay != NULL) {
+            adb_hal_apacket_release(svc->client, okay);
+        }
+#endif
+        return -1;
+    }
+
+    svc->write_pending += 1;
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (okay != NULL) {
+        svc->write_queued += p->write_len;
+        adb_send_okay_frame(svc->client, okay,
+            svc->service.id, svc->service.peer_id);
+    }
+#endif
+
+    /* Notify ADB client that packet is now managed by service */
+    return 1;
+}
+
+static int dev_ack(adb_service_t *service, apacket *p) {
+    adev_service_t *svc = container_of(service, adev_service_t, service);
+
+    UNUSED(p);
+
+    svc->wait_ack = 0;
+    dev_kick(service);
+    return 0;
+}
+
+static void dev_kick(adb_service_t *service) {
+    adev_service_t *svc = container_of(service, adev_service_t, service);
+
+    if (svc->wait_ack || uv_is_active((uv_handle_t*)&svc->pipe)) {
+        return;
+    }
+
+    /* No need to check return code as it would only fail when
+     * device is closing */
+    uv_read_start((uv_stream_t*)&svc->pipe,
+        dev_alloc_buffer, dev_on_data_available);
+}
+
+static void dev_close_callback(uv_handle_t *handle) {
+    free(container_of(handle, adev_service_t, pipe));
+}
+
+static void dev_close(adb_service_t *service) {
+    adev_service_t *svc = container_of(service, adev_service_t, service);
+
+    svc->closed = 1;
+    adb_uv_packet_disown(
+        container_of(svc->client, adb_client_uv_t, client),
+        svc->write_pending);
+
+    /* Pending writes are cancelled, device is closed with handle */
+    uv_close((uv_handle_t*)&svc->pipe, dev_close_callback);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+adb_service_t *dev_service(adb_client_t *client, const char *params) {
+    char path[PATH_MAX];
+    const char *sep;
+    char *end;
+    unsigned long baud = 0;
+    size_t len;
+    int fd;
+    adev_service_t *svc;
+
+    /* Service name is <dev:path[,baud]> */
+
+    params += sizeof(ADB_DEV_PREFIX) - 1;
+    sep = strchr(params, ',');
+    len = sep != NULL ? (size_t)(sep - params) : strlen(params);
+
+    if (len == 0 || len >= sizeof(path)) {
+        return NULL;
+    }
+
+    memcpy(path, params, len);
+    path[len] = 0;
+
+    if (sep != NULL) {
+        baud = strtoul(sep + 1, &end, 10);
+        if (end == sep + 1 || *end != 0 || baud == 0) {
+            return NULL;
+        }
+    }
+
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        adb_err("cannot open %s (%d)\n", path, errno);
+        return NULL;
+    }
+
+    if (dev_setup_tty(fd, baud)) {
+        adb_err("cannot setup %s (%d)\n", path, errno);
+        goto exit_close_fd;
+    }
+
+    svc = (adev_service_t*)malloc(sizeof(adev_service_t));
+    if (svc == NULL) {
+        goto exit_close_fd;
+    }
+
+    if (uv_pipe_init(adb_uv_get_client_handle(client)->loop,
+                     &svc->pipe, 0)) {
+        free(svc);
+        goto exit_close_fd;
+    }
+
+    if (uv_pipe_open(&svc->pipe, fd)) {
+        /* Handle is closed before service is freed */
+        uv_close((uv_handle_t*)&svc->pipe, dev_close_callback);
+        goto exit_close_fd;
+    }
+
+    svc->service.ops = &dev_ops;
+    svc->client = client;
+    svc->wait_ack = 0;
+    svc->write_pending = 0;
+    svc->closed = 0;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    svc->write_queued = 0;
+#endif
+
+    /* Start waiting for data from device */
+
+    dev_kick(&svc->service);
+    return &svc->service;
+
+exit_close_fd:
+    close(fd);
+    return NULL;
+}
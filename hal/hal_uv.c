@@ -25,6 +25,34 @@
 
 static adb_context_uv_t g_adbd_context;
 
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+typedef struct adb_work_uv_s {
+    uv_work_t req;
+    void (*work_cb)(void *arg);
+    void (*after_work_cb)(void *arg);
+    void *arg;
+} adb_work_uv_t;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void work_uv_cb(uv_work_t *req) {
+    adb_work_uv_t *work = container_of(req, adb_work_uv_t, req);
+    work->work_cb(work->arg);
+}
+
+static void after_work_uv_cb(uv_work_t *req, int status) {
+    adb_work_uv_t *work = container_of(req, adb_work_uv_t, req);
+    UNUSED(status);
+
+    work->after_work_cb(work->arg);
+    free(work);
+}
+
 /****************************************************************************
  * HAL Public Functions
  ****************************************************************************/
@@ -79,6 +107,29 @@ int adb_hal_run(adb_context_t *context) {
     return 0;
 }
 
+int adb_hal_queue_work(adb_client_t *client, void (*work_cb)(void *arg),
+                       void (*after_work_cb)(void *arg), void *arg) {
+    int ret;
+    adb_work_uv_t *work;
+
+    work = (adb_work_uv_t*)malloc(sizeof(adb_work_uv_t));
+    if (work == NULL) {
+        return -ENOMEM;
+    }
+
+    work->work_cb = work_cb;
+    work->after_work_cb = after_work_cb;
+    work->arg = arg;
+
+    ret = uv_queue_work(adb_uv_get_client_handle(client)->loop, &work->req,
+                        work_uv_cb, after_work_uv_cb);
+    if (ret) {
+        free(work);
+    }
+
+    return ret;
+}
+
 #ifdef CONFIG_ADBD_AUTHENTICATION
 int adb_hal_random(void *buf, size_t len) {
     return uv_random(NULL, NULL, buf, len, 0, NULL);
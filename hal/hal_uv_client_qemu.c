@@ -100,6 +100,11 @@ static void qemu_uv_on_close(uv_handle_t *handle) {
 static void qemu_uv_close(adb_client_t *c) {
     adb_client_qemu_t *client = container_of(c, adb_client_qemu_t, uc.client);
 
+    if (uv_is_closing((uv_handle_t *)&client->pipe)) {
+        /* Every pending write fails once connection is lost */
+        return;
+    }
+
     /* Close pipe and cancel all pending write requests if any */
     uv_close((uv_handle_t *)&client->pipe, qemu_uv_on_close);
 }
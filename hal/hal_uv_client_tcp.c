@@ -15,6 +15,14 @@
  *
  */
 
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+#define _GNU_SOURCE 1 /* Force _GNU_SOURCE (required for splice) */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+
 #include <arpa/inet.h>
 
 #include "adb.h"
@@ -73,6 +81,107 @@ static int tcp_uv_write(adb_client_t *c, apacket *p) {
     return 0;
 }
 
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+static int tcp_uv_splice(adb_client_t *c, apacket *p, int fd) {
+    apacket_uv_t *up = container_of(p, apacket_uv_t, p);
+    adb_client_tcp_t *client = container_of(c, adb_client_tcp_t, uc.client);
+    size_t frame_len = sizeof(p->msg) + p->msg.data_length;
+    size_t sent = 0;
+    size_t len;
+    ssize_t ret;
+    uv_os_fd_t sock;
+    uv_buf_t buf;
+
+    /* Frames queued in libuv must be sent first */
+
+    if (uv_stream_get_write_queue_size((uv_stream_t*)&client->socket) > 0 ||
+        uv_fileno((uv_handle_t*)&client->socket, &sock)) {
+        return -EAGAIN;
+    }
+
+    while (sent < sizeof(p->msg)) {
+        ret = send(sock, (char*)&p->msg + sent,
+                   sizeof(p->msg) - sent, MSG_MORE);
+        if (ret > 0) {
+            sent += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            if (sent == 0) {
+                /* Nothing sent, caller copies payload */
+                return -EAGAIN;
+            }
+            break;
+        }
+
+        return -EIO;
+    }
+
+    /* Payload moves from pipe to socket without being copied here */
+
+    while (sent >= sizeof(p->msg) && sent < frame_len) {
+        ret = splice(fd, NULL, sock, NULL, frame_len - sent,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0) {
+            sent += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            break;
+        }
+
+        return -EIO;
+    }
+
+    if (sent == frame_len) {
+        adb_hal_apacket_release(c, p);
+        return 0;
+    }
+
+    /* Socket is full. Pipe still holds rest of payload, it is read in
+     * packet and queued in libuv with rest of frame, other frames are
+     * held back until it is sent */
+
+    len = sent > sizeof(p->msg) ? sent - sizeof(p->msg) : 0;
+    while (len < p->msg.data_length) {
+        ret = read(fd, p->data + len, p->msg.data_length - len);
+        if (ret > 0) {
+            len += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return -EIO;
+    }
+
+    buf = uv_buf_init((char*)&p->msg + sent, frame_len - sent);
+
+    /* Packet is now tracked by libuv, released once written */
+    p->write_len = 0;
+    up->wr.data = &client->uc;
+
+    if (uv_write(&up->wr, (uv_stream_t*)&client->socket, &buf, 1,
+                 adb_uv_after_write)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+#endif
+
 static void tcp_uv_kick(adb_client_t *c) {
     adb_client_tcp_t *client = container_of(c, adb_client_tcp_t, uc.client);
 
@@ -96,6 +205,11 @@ static void tcp_uv_on_close(uv_handle_t* handle) {
 static void tcp_uv_close(adb_client_t *c) {
     adb_client_tcp_t *client = (adb_client_tcp_t*)c;
 
+    if (uv_is_closing((uv_handle_t*)&client->socket)) {
+        /* Every pending write fails once connection is lost */
+        return;
+    }
+
     /* Close socket and cancel all pending write requests if any */
     uv_close((uv_handle_t*)&client->socket, tcp_uv_on_close);
 }
@@ -103,7 +217,10 @@ static void tcp_uv_close(adb_client_t *c) {
 static const adb_client_ops_t adb_tcp_uv_ops = {
     .write = tcp_uv_write,
     .kick  = tcp_uv_kick,
-    .close = tcp_uv_close
+    .close = tcp_uv_close,
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    .splice = tcp_uv_splice,
+#endif
 };
 
 static void tcp_on_connection(uv_stream_t* server, int status) {
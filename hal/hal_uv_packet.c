@@ -59,6 +59,27 @@ void adb_hal_apacket_release(adb_client_t *c, apacket *p) {
     }
 }
 
+void adb_uv_packet_disown(adb_client_uv_t *client, unsigned count) {
+    int stalled = client->frame_count > CONFIG_ADBD_FRAME_MAX;
+
+    if (count == 0) {
+        return;
+    }
+
+    /* Sanity check */
+    assert(client->frame_count >= (int)count);
+
+    if (stalled) {
+        client->frame_count = CONFIG_ADBD_FRAME_MAX;
+    }
+    client->frame_count -= count;
+
+    if (stalled && client->client.is_connected) {
+        /* Resume allocation that failed */
+        client->client.ops->kick(&client->client);
+    }
+}
+
 apacket_uv_t* adb_uv_packet_allocate(adb_client_uv_t *client, int before_connect)
 {
     apacket_uv_t* p;
@@ -200,7 +221,7 @@ void adb_uv_on_data_available(adb_client_uv_t *client, uv_stream_t *stream,
 
     /* Check data */
 
-    if(adb_check_frame_data(&up->p)) {
+    if(!client->client.skip_checksum && adb_check_frame_data(&up->p)) {
         adb_err("bad data: terminated (data)\n");
         client->client.ops->close(&client->client);
         return;
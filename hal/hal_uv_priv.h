@@ -91,6 +91,12 @@ apacket_uv_t* adb_uv_packet_allocate(adb_client_uv_t *client,
                                      int before_connect);
 void adb_uv_packet_release(adb_client_uv_t *c, apacket_uv_t *p);
 
+/* Frames held by writes of a closed handle are no longer counted for
+ * client, which may be freed before write callbacks run. Such frames
+ * are then freed directly. */
+
+void adb_uv_packet_disown(adb_client_uv_t *client, unsigned count);
+
 void adb_uv_allocate_frame(adb_client_uv_t *client, uv_buf_t* buf);
 
 /* hal stream helpers */
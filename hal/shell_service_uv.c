@@ -16,15 +16,25 @@
  */
 
 #define _DEFAULT_SOURCE 1 /* Force _DEFAULT_SOURCE (required for cfmakeraw) */
+#define _GNU_SOURCE 1     /* Force _GNU_SOURCE (required for pipe2) */
 #define _XOPEN_SOURCE 600 /* Force _XOPEN_SOURCE (required for pty features) */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <termios.h>
 
+#ifdef CONFIG_ADBD_SHELL_VFORK
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include "adb.h"
@@ -35,13 +45,146 @@
  * Private types
  ****************************************************************************/
 
+/* Shell protocol packet: <id:1><length:4 LE><data> */
+
+#define SHELL_V2_HDR_SIZE     5
+
+#define SHELL_V2_STDIN        0
+#define SHELL_V2_STDOUT       1
+#define SHELL_V2_STDERR       2
+#define SHELL_V2_EXIT         3
+#define SHELL_V2_CLOSE_STDIN  4
+#define SHELL_V2_WINDOW_SIZE  5
+
+/* Pool refill is delayed so that spawning does not hold output of the
+ * command just started */
+
+#define SHELL_POOL_FILL_DELAY_MS 20
+
+/* Detached sessions kept at most, least recently detached one is
+ * dropped first */
+
+#define SHELL_SESSION_MAX        4
+#define SHELL_SESSION_TOKEN_MAX  32
+
 typedef struct ash_service_s {
     adb_service_t service;
     uv_pipe_t shell_pipe;
+#ifdef CONFIG_ADBD_SHELL_VFORK
+    /* Child spawned with posix_spawn, reaped on SIGCHLD until pid
+     * is cleared. Service is freed once both child is reaped and
+     * handles are closed. */
+    struct ash_service_s *child_next;
+    pid_t pid;
+    uint8_t closed;
+#else
     uv_process_t process;
+#endif
     int wait_ack;
+    /* Host input writes not completed yet. Their frames are no longer
+     * counted for client once service is closed. */
+    unsigned write_pending;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    /* Host input queued to child and already acknowledged */
+    size_t write_queued;
+#endif
+
+    /* Output frame being filled */
+    apacket *packet;
+    /* End of output reported while frame was not sent */
+    int eof;
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    /* Shell output is accumulated in frame until it is full or deadline
+     * expires. Output following host input is sent at once as it is
+     * likely an echo. */
+    uv_timer_t timer;
+    int echo;
+#endif
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    /* Command spawned over pipes instead of pty, host input is written
+     * to input_pipe */
+    int raw;
+    uv_pipe_t input_pipe;
+#endif
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    /* Raw output is moved from pipe to transport when possible.
+     * splice_fd is polled instead of reading shell_pipe. */
+    int splice_fd;
+    uv_poll_t splice_poll;
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    /* Input and output are framed as shell protocol packets. Exit code
+     * is sent once output is over and child has exited, then service
+     * is closed. */
+    int v2;
+    int exit_code;
+    uint8_t output_done;
+    uint8_t exit_sent;
+    uint8_t input_eof;
+
+    /* Separate stderr of commands spawned over pipes */
+    uint8_t error_open;
+    uv_pipe_t error_pipe;
+
+    /* Host packet being parsed, may be split across frames */
+    uint8_t in_hdr[SHELL_V2_HDR_SIZE];
+    uint8_t in_hdr_len;
+    uint32_t in_left;
+    uint8_t in_ctl_len;
+    char in_ctl[32];
+#endif
+#ifdef CONFIG_ADBD_SHELL_POOL
+    /* Idle shell sourcing its command from ctl_fd once taken */
+    struct ash_service_s *pool_next;
+    int ctl_fd;
+    uint8_t pooled;
+#endif
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    /* Pty shell kept running when transport is lost. Output is then
+     * buffered in replay ring until host reattaches with same token. */
+    struct ash_service_s *session_next;
+    char session[SHELL_SESSION_TOKEN_MAX + 1];
+    uint8_t detached;
+    unsigned detach_seq;
+    uint8_t exited;
+    uint8_t *replay;
+    size_t replay_head;
+    size_t replay_len;
+    /* Output of last frame sent, kept until host acknowledges it */
+    uint8_t *unacked;
+    size_t unacked_len;
+#endif
 } ash_service_t;
 
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+/* Shells spawned ahead of commands, shared by all sessions.
+ * Only accessed from adb thread. */
+
+static ash_service_t *g_shell_pool;
+static unsigned g_shell_pool_count;
+static uv_timer_t g_shell_pool_timer;
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_VFORK
+/* Children spawned by all sessions. Only accessed from adb thread. */
+
+static ash_service_t *g_shell_children;
+static uv_signal_t g_shell_sigchld;
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+/* Shells opened with a session token, attached or not.
+ * Only accessed from adb thread. */
+
+static ash_service_t *g_shell_sessions;
+static unsigned g_shell_sessions_detached;
+static unsigned g_shell_sessions_seq;
+#endif
+
 /****************************************************************************
  * Private Function Prototypes
  ****************************************************************************/
@@ -50,186 +193,1884 @@ typedef struct ash_service_s {
 static int shell_set_cloexec(int fd);
 #endif
 
+#ifdef CONFIG_ADBD_SHELL_EXEC
+static int shell_open_pipe(int fds[2]);
+#endif
+static const char *shell_parse_params(ash_service_t *svc,
+                                      const char *params);
+
+static void shell_exited(ash_service_t *svc, int64_t exit_status,
+                         int term_signal);
+#ifdef CONFIG_ADBD_SHELL_VFORK
+static void on_child_signal(uv_signal_t *handle, int signum);
+static int shell_vfork(ash_service_t *svc, uv_loop_t *loop,
+                       const uv_process_options_t *options);
+#else
 static void on_child_exit(uv_process_t *process, int64_t exit_status,
                           int term_signal);
+#endif
+
+static void shell_alloc(ash_service_t *svc, uv_buf_t *buf);
+static void shell_output(ash_service_t *svc, int id, ssize_t nread);
+static void shell_flush(ash_service_t *svc);
+
+static void alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf);
+static void pipe_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                   const uv_buf_t* buf);
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+static void shell_on_deadline(uv_timer_t *timer);
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+static void shell_splice_setup(ash_service_t *svc, uv_loop_t *loop);
+static void shell_on_splice(uv_poll_t *handle, int status, int events);
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+static void error_alloc_buffer(uv_handle_t *handle, size_t len,
+                               uv_buf_t *buf);
+static void error_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                    const uv_buf_t* buf);
+static int shell_send_exit(ash_service_t *svc);
+static size_t shell_parse_input(ash_service_t *svc, uint8_t *data,
+                                size_t len);
+static void shell_close_input(ash_service_t *svc);
+#endif
+
+static int shell_write(adb_service_t *service, apacket *p);
+static void shell_after_write(uv_write_t* req, int status);
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+static void shell_after_queued_write(uv_write_t* req, int status);
+#endif
+
+static int shell_ack(adb_service_t *service, apacket *p);
+static void shell_close(struct adb_service_s *service);
+static void shell_kick(adb_service_t *service);
+
+static ash_service_t *shell_new(adb_client_t *client);
+static int shell_spawn(ash_service_t *service, uv_loop_t *loop,
+                       char **argv, int interactive);
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+static void shell_pool_fill(uv_timer_t *timer);
+static void shell_pool_schedule(uv_loop_t *loop);
+static void shell_pool_remove(ash_service_t *svc);
+static int shell_pool_send(ash_service_t *svc, const char *cmd);
+static ash_service_t *shell_pool_take(adb_client_t *client,
+                                      ash_service_t *req, const char *cmd);
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+static ash_service_t *shell_session_find(const char *token);
+static void shell_session_remove(ash_service_t *svc);
+static int shell_session_detach(ash_service_t *svc);
+static void shell_session_attach(ash_service_t *svc, adb_client_t *client,
+                                 ash_service_t *req);
+static void shell_replay(ash_service_t *svc);
+static size_t session_copy_output(ash_service_t *svc, uint8_t *dst,
+                                  const uint8_t *src, size_t len);
+static void session_replay_prepend(ash_service_t *svc, const uint8_t *data,
+                                   size_t len);
+static void session_alloc_buffer(uv_handle_t *handle, size_t len,
+                                 uv_buf_t *buf);
+static void session_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                      const uv_buf_t* buf);
+#endif
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+#ifndef O_CLOEXEC
+static int shell_set_cloexec(int fd) {
+    int ret;
+
+    if ((ret = fcntl(fd, F_GETFD)) < 0) {
+        return ret;
+    }
+
+    ret = ret | FD_CLOEXEC;
+
+    if ((ret = fcntl(fd, F_SETFD, ret)) < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+static int shell_open_pipe(int fds[2]) {
+#ifdef O_CLOEXEC
+    if (pipe2(fds, O_CLOEXEC)) {
+        return -1;
+    }
+#else
+    if (pipe(fds)) {
+        return -1;
+    }
+
+    if (shell_set_cloexec(fds[0]) || shell_set_cloexec(fds[1])) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+#endif
+
+#ifdef F_SETPIPE_SZ
+    /* Best effort, size may be above system limit */
+    fcntl(fds[0], F_SETPIPE_SZ, CONFIG_ADBD_SHELL_PIPE_SIZE);
+#endif
+    return 0;
+}
+#endif
+
+static const char *shell_parse_params(ash_service_t *svc,
+                                      const char *params) {
+    const char *cmd;
+    const char *opt;
+    size_t len;
+
+    /* Service name is <shell[,opt...]:command> or <exec:command> */
+
+    cmd = strchr(params, ':');
+    if (cmd == NULL) {
+        return NULL;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    svc->raw = !strncmp(params, ADB_EXEC_PREFIX, sizeof(ADB_EXEC_PREFIX)-1);
+#endif
+
+    opt = strchr(params, ',');
+    while (opt != NULL && opt < cmd) {
+        opt += 1;
+        len = strcspn(opt, ",:");
+
+        /* Other options are ignored */
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+        if (len == 3 && !strncmp(opt, "raw", 3)) {
+            svc->raw = 1;
+        }
+        else if (len == 3 && !strncmp(opt, "pty", 3)) {
+            svc->raw = 0;
+        }
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+        if (len == 2 && !strncmp(opt, "v2", 2)) {
+            svc->v2 = 1;
+        }
+#endif
+#ifdef CONFIG_ADBD_SHELL_SESSION
+        if (len > 8 && !strncmp(opt, "session=", 8)) {
+            /* Token is chosen by host: session=[A-Za-z0-9_-]+ */
+
+            len -= 8;
+            if (len > SHELL_SESSION_TOKEN_MAX ||
+                strspn(opt + 8, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                "abcdefghijklmnopqrstuvwxyz"
+                                "0123456789_-") != len) {
+                return NULL;
+            }
+
+            memcpy(svc->session, opt + 8, len);
+            svc->session[len] = 0;
+        }
+#endif
+
+        opt = strchr(opt, ',');
+    }
+
+#if defined(CONFIG_ADBD_SHELL_SESSION) && defined(CONFIG_ADBD_SHELL_EXEC)
+    if (svc->raw) {
+        /* Only pty shells are kept, commands over pipes are not
+         * interactive */
+        svc->session[0] = 0;
+    }
+#endif
+
+    UNUSED(svc);
+    UNUSED(len);
+    return cmd + 1;
+}
+
+static void shell_exited(ash_service_t *svc, int64_t exit_status,
+                         int term_signal) {
+    adb_log("shell %d<->%d exited with status %ld, signal %d\n",
+        svc->service.id, svc->service.peer_id,
+        exit_status, term_signal);
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+    if (svc->pooled) {
+        /* Idle shell is dropped */
+        shell_pool_remove(svc);
+        shell_close(&svc->service);
+        return;
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    svc->exited = 1;
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (uv_is_closing((uv_handle_t*)&svc->shell_pipe)) {
+        return;
+    }
+
+    svc->exit_code = term_signal ? 128 + term_signal : exit_status & 0xff;
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    if (svc->detached) {
+        /* Reported once host reattaches */
+        return;
+    }
+#endif
+
+    shell_kick(&svc->service);
+#endif
+}
+
+#ifdef CONFIG_ADBD_SHELL_VFORK
+static void on_child_signal(uv_signal_t *handle, int signum) {
+    ash_service_t **cur = &g_shell_children;
+    ash_service_t *svc;
+    int status;
+
+    UNUSED(handle);
+    UNUSED(signum);
+
+    /* Only reap own children, others may be managed by uv */
+
+    while ((svc = *cur) != NULL) {
+        if (waitpid(svc->pid, &status, WNOHANG) != svc->pid) {
+            cur = &svc->child_next;
+            continue;
+        }
+
+        *cur = svc->child_next;
+        svc->pid = 0;
+
+        if (svc->closed) {
+            free(svc);
+            continue;
+        }
+
+        shell_exited(svc,
+            WIFEXITED(status) ? WEXITSTATUS(status) : 0,
+            WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+}
+
+static int shell_vfork(ash_service_t *svc, uv_loop_t *loop,
+                       const uv_process_options_t *options) {
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    short flags;
+    int i;
+    int ret;
+
+    if (g_shell_sigchld.loop == NULL) {
+        /* Started before first child so that no exit is missed */
+
+        ret = uv_signal_init(loop, &g_shell_sigchld);
+        if (!ret) {
+            ret = uv_signal_start(&g_shell_sigchld, on_child_signal,
+                                  SIGCHLD);
+        }
+        if (ret) {
+            return ret;
+        }
+        uv_unref((uv_handle_t*)&g_shell_sigchld);
+    }
+
+    if ((ret = posix_spawn_file_actions_init(&actions))) {
+        return -ret;
+    }
+
+    if ((ret = posix_spawnattr_init(&attr))) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -ret;
+    }
+
+    /* Other descriptors are close-on-exec */
+
+    for (i = 0; i < options->stdio_count && !ret; i++) {
+        ret = posix_spawn_file_actions_adddup2(&actions,
+                options->stdio[i].data.fd, i);
+    }
+
+    /* Same as uv_spawn, child starts with default signal handling */
+
+    flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+#ifdef POSIX_SPAWN_SETSID
+    if (options->flags & UV_PROCESS_DETACHED) {
+        flags |= POSIX_SPAWN_SETSID;
+    }
+#endif
+
+    sigemptyset(&signals);
+    if (!ret) {
+        ret = posix_spawnattr_setsigmask(&attr, &signals);
+    }
+    sigfillset(&signals);
+    if (!ret) {
+        ret = posix_spawnattr_setsigdefault(&attr, &signals);
+    }
+    if (!ret) {
+        ret = posix_spawnattr_setflags(&attr, flags);
+    }
+    if (!ret) {
+        ret = posix_spawn(&svc->pid, options->file, &actions, &attr,
+                          options->args, environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (ret) {
+        svc->pid = 0;
+        return -ret;
+    }
+
+    svc->child_next = g_shell_children;
+    g_shell_children = svc;
+    return 0;
+}
+#else
+static void on_child_exit(uv_process_t *process, int64_t exit_status,
+        int term_signal) {
+    shell_exited((ash_service_t*)process->data, exit_status, term_signal);
+}
+#endif
+
+static void shell_alloc(ash_service_t *svc, uv_buf_t *buf) {
+    apacket_uv_t *ap;
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+    size_t offset;
+
+    assert(svc->wait_ack == 0);
+
+    if (svc->packet == NULL) {
+        ap = adb_uv_packet_allocate(client, 0);
+        if (ap == NULL) {
+            buf->base = NULL;
+            buf->len = 0;
+            return;
+        }
+
+        ap->p.write_len = 0;
+        svc->packet = &ap->p;
+    }
+
+    /* Append to output not sent yet */
+
+    offset = svc->packet->write_len;
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->v2) {
+        /* Header is filled once read is done */
+        offset += SHELL_V2_HDR_SIZE;
+    }
+#endif
+
+    buf->base = (char*)&svc->packet->data[offset];
+    buf->len = CONFIG_ADBD_PAYLOAD_SIZE - offset;
+}
+
+static void shell_output(ash_service_t *svc, int id, ssize_t nread) {
+    apacket *p = svc->packet;
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->v2) {
+        uint8_t *hdr = &p->data[p->write_len];
+
+        hdr[0] = id;
+        hdr[1] = nread;
+        hdr[2] = nread >> 8;
+        hdr[3] = nread >> 16;
+        hdr[4] = nread >> 24;
+        p->write_len += SHELL_V2_HDR_SIZE;
+    }
+#else
+    UNUSED(id);
+#endif
+
+    p->write_len += nread;
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    unsigned room = CONFIG_ADBD_PAYLOAD_SIZE - p->write_len;
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->v2) {
+        room = room > SHELL_V2_HDR_SIZE ? room - SHELL_V2_HDR_SIZE : 0;
+    }
+#endif
+
+    if (room > 0 && !svc->echo) {
+        /* Wait for more output until deadline */
+        if (!uv_is_active((uv_handle_t*)&svc->timer)) {
+            uv_timer_start(&svc->timer, shell_on_deadline,
+                           CONFIG_ADBD_SHELL_COALESCE_MS, 0);
+        }
+        return;
+    }
+
+    svc->echo = 0;
+#endif
+
+    shell_flush(svc);
+}
+
+static void shell_flush(ash_service_t *svc) {
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+    apacket *p = svc->packet;
+
+    svc->packet = NULL;
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    uv_timer_stop(&svc->timer);
+#endif
+
+    /* Wait for ACK before processing next frame from shell */
+
+    svc->wait_ack = 1;
+    uv_read_stop((uv_stream_t*)&svc->shell_pipe);
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    if (svc->splice_fd >= 0) {
+        uv_poll_stop(&svc->splice_poll);
+    }
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->error_open) {
+        uv_read_stop((uv_stream_t*)&svc->error_pipe);
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    if (svc->session[0] != 0) {
+        /* Replayed if transport is lost before frame is acknowledged */
+        if (svc->unacked == NULL) {
+            svc->unacked = (uint8_t*)malloc(CONFIG_ADBD_PAYLOAD_SIZE);
+        }
+        if (svc->unacked != NULL) {
+            svc->unacked_len = session_copy_output(svc, svc->unacked,
+                                                   p->data, p->write_len);
+        }
+    }
+#endif
+
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(&client->client, p);
+}
+
+static void alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf) {
+    UNUSED(len);
+    ash_service_t *service = container_of(handle, ash_service_t, shell_pipe);
+
+    shell_alloc(service, buf);
+}
+
+static void pipe_on_data_available(uv_stream_t* stream, ssize_t nread,
+        const uv_buf_t* buf) {
+    ash_service_t *service = container_of(stream, ash_service_t, shell_pipe);
+    adb_client_uv_t *client = (adb_client_uv_t *)service->shell_pipe.data;
+    apacket *p;
+
+    UNUSED(buf);
+
+    if (nread == UV_ENOBUFS) {
+        /* No frame available, stop read events for now */
+        uv_read_stop((uv_stream_t*)&service->shell_pipe);
+        return;
+    }
+
+    if (nread == 0) {
+        /* Nothing read */
+        return;
+    }
+
+    if (nread > 0) {
+        shell_output(service, SHELL_V2_STDOUT, nread);
+        return;
+    }
+
+    p = service->packet;
+
+    if (p->write_len > 0) {
+        /* Send remaining output first. Hang up of pty is reported as
+         * end of stream while output may still be pending, so reading
+         * is resumed once frame is acknowledged */
+        service->eof = 1;
+        shell_flush(service);
+        return;
+    }
+
+    if (nread != UV_EOF) {
+        adb_err("closing due to error: %d\n", nread);
+    }
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (service->v2) {
+        /* Exit code is sent once child has exited */
+        service->output_done = 1;
+        shell_kick(&service->service);
+        return;
+    }
+#endif
+
+    service->packet = NULL;
+    adb_service_close(&client->client, &service->service, p);
+}
+
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+static void shell_splice_setup(ash_service_t *svc, uv_loop_t *loop) {
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+    uv_os_fd_t fd;
+
+    /* Payload of raw output needs no framing nor checksum */
+
+    if (!svc->raw || !client->client.skip_checksum ||
+        client->client.ops->splice == NULL) {
+        return;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->v2) {
+        return;
+    }
+#endif
+
+    if (uv_fileno((uv_handle_t*)&svc->shell_pipe, &fd)) {
+        return;
+    }
+
+    /* Separate descriptor as libuv does not allow polling a fd twice */
+
+    svc->splice_fd = dup(fd);
+    if (svc->splice_fd < 0) {
+        return;
+    }
+
+    if (uv_poll_init(loop, &svc->splice_poll, svc->splice_fd)) {
+        close(svc->splice_fd);
+        svc->splice_fd = -1;
+    }
+}
+
+static void shell_on_splice(uv_poll_t *handle, int status, int events) {
+    ash_service_t *svc = container_of(handle, ash_service_t, splice_poll);
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+    apacket_uv_t *ap;
+    apacket *p;
+    ssize_t len;
+    int avail;
+
+    UNUSED(status);
+    UNUSED(events);
+
+    ap = adb_uv_packet_allocate(client, 0);
+    if (ap == NULL) {
+        /* Restarted on next kick */
+        uv_poll_stop(handle);
+        return;
+    }
+
+    p = &ap->p;
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+
+    if (ioctl(svc->splice_fd, FIONREAD, &avail) == 0 && avail > 0) {
+        p->write_len = avail < CONFIG_ADBD_PAYLOAD_SIZE ?
+                       avail : CONFIG_ADBD_PAYLOAD_SIZE;
+
+        len = adb_send_data_frame_from_fd(&client->client, p,
+                                          svc->splice_fd);
+        if (len == 0) {
+            /* Packet is consumed by transport */
+            svc->wait_ack = 1;
+            uv_poll_stop(handle);
+            return;
+        }
+
+        if (len != -EAGAIN) {
+            /* Client is being closed and service with it, pipe must
+             * not be polled meanwhile */
+            adb_hal_apacket_release(&client->client, p);
+            uv_poll_stop(handle);
+            return;
+        }
+    }
+
+    /* Transport is busy or end of output, copy as usual */
+
+    do {
+        len = read(svc->splice_fd, p->data, CONFIG_ADBD_PAYLOAD_SIZE);
+    } while (len < 0 && errno == EINTR);
+
+    if (len > 0) {
+        p->write_len = len;
+        svc->packet = p;
+        shell_flush(svc);
+        return;
+    }
+
+    if (len < 0 && errno == EAGAIN) {
+        adb_hal_apacket_release(&client->client, p);
+        return;
+    }
+
+    if (len < 0) {
+        adb_err("closing due to error: %d\n", errno);
+    }
+
+    adb_service_close(&client->client, &svc->service, p);
+}
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+static void shell_on_deadline(uv_timer_t *timer) {
+    ash_service_t *svc = container_of(timer, ash_service_t, timer);
+
+    if (svc->packet != NULL && svc->packet->write_len > 0) {
+        shell_flush(svc);
+    }
+}
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+static void error_alloc_buffer(uv_handle_t *handle, size_t len,
+                               uv_buf_t *buf) {
+    UNUSED(len);
+    ash_service_t *service = container_of(handle, ash_service_t, error_pipe);
+
+    shell_alloc(service, buf);
+}
+
+static void error_on_data_available(uv_stream_t* stream, ssize_t nread,
+        const uv_buf_t* buf) {
+    ash_service_t *service = container_of(stream, ash_service_t, error_pipe);
+
+    UNUSED(buf);
+
+    if (nread == UV_ENOBUFS) {
+        /* No frame available, stop read events for now */
+        uv_read_stop(stream);
+        return;
+    }
+
+    if (nread == 0) {
+        /* Nothing read */
+        return;
+    }
+
+    if (nread > 0) {
+        shell_output(service, SHELL_V2_STDERR, nread);
+        return;
+    }
+
+    /* Output read so far is already framed */
+
+    service->error_open = 0;
+    uv_close((uv_handle_t*)stream, NULL);
+    shell_kick(&service->service);
+}
+
+static int shell_send_exit(ash_service_t *svc) {
+    apacket *p;
+    uv_buf_t buf;
+
+    if (!svc->v2 || !svc->output_done || svc->error_open ||
+        svc->exit_code < 0) {
+        return 0;
+    }
+
+    shell_alloc(svc, &buf);
+    if (buf.base == NULL) {
+        /* Retry on next kick */
+        return 1;
+    }
+
+    p = svc->packet;
+    if (p->write_len + SHELL_V2_HDR_SIZE + 1 > CONFIG_ADBD_PAYLOAD_SIZE) {
+        /* Send output first */
+        shell_flush(svc);
+        return 1;
+    }
+
+    p->data[p->write_len] = SHELL_V2_EXIT;
+    p->data[p->write_len + 1] = 1;
+    p->data[p->write_len + 2] = 0;
+    p->data[p->write_len + 3] = 0;
+    p->data[p->write_len + 4] = 0;
+    p->data[p->write_len + 5] = svc->exit_code;
+    p->write_len += SHELL_V2_HDR_SIZE + 1;
+
+    /* Service is closed once exit code is acknowledged */
+
+    svc->exit_sent = 1;
+    shell_flush(svc);
+    return 1;
+}
+
+static void shell_set_window_size(ash_service_t *svc) {
+    int rows, cols, x, y;
+    struct winsize ws;
+    uv_os_fd_t fd;
+
+    /* Format is <rows>x<cols>,<x_pixels>x<y_pixels> */
+
+    svc->in_ctl[svc->in_ctl_len] = 0;
+    if (sscanf(svc->in_ctl, "%dx%d,%dx%d", &rows, &cols, &x, &y) != 4) {
+        return;
+    }
+
+    if (svc->raw || uv_fileno((uv_handle_t*)&svc->shell_pipe, &fd)) {
+        return;
+    }
+
+    ws.ws_row = rows;
+    ws.ws_col = cols;
+    ws.ws_xpixel = x;
+    ws.ws_ypixel = y;
+    ioctl(fd, TIOCSWINSZ, &ws);
+}
+
+static size_t shell_parse_input(ash_service_t *svc, uint8_t *data,
+                                size_t len) {
+    uint8_t *ptr = data;
+    size_t stdin_len = 0;
+    size_t n;
+
+    /* Content of stdin packets is moved to start of data */
+
+    while (len > 0) {
+        if (svc->in_hdr_len < SHELL_V2_HDR_SIZE) {
+            n = SHELL_V2_HDR_SIZE - svc->in_hdr_len;
+            n = len < n ? len : n;
+            memcpy(&svc->in_hdr[svc->in_hdr_len], ptr, n);
+            svc->in_hdr_len += n;
+            ptr += n;
+            len -= n;
+
+            if (svc->in_hdr_len < SHELL_V2_HDR_SIZE) {
+                break;
+            }
+
+            svc->in_left = svc->in_hdr[1] | svc->in_hdr[2] << 8 |
+                svc->in_hdr[3] << 16 | (uint32_t)svc->in_hdr[4] << 24;
+            svc->in_ctl_len = 0;
+        }
+        else {
+            n = len < svc->in_left ? len : svc->in_left;
+
+            if (svc->in_hdr[0] == SHELL_V2_STDIN) {
+                if (!svc->input_eof) {
+                    memmove(&data[stdin_len], ptr, n);
+                    stdin_len += n;
+                }
+            }
+            else {
+                /* Control packet, truncated if too long */
+                size_t m = sizeof(svc->in_ctl) - 1 - svc->in_ctl_len;
+                m = n < m ? n : m;
+                memcpy(&svc->in_ctl[svc->in_ctl_len], ptr, m);
+                svc->in_ctl_len += m;
+            }
+
+            ptr += n;
+            len -= n;
+            svc->in_left -= n;
+        }
+
+        if (svc->in_left > 0) {
+            continue;
+        }
+
+        /* Packet complete */
+
+        switch (svc->in_hdr[0]) {
+            case SHELL_V2_CLOSE_STDIN:
+                svc->input_eof = 1;
+                break;
+            case SHELL_V2_WINDOW_SIZE:
+                shell_set_window_size(svc);
+                break;
+            default:
+                break;
+        }
+
+        svc->in_hdr_len = 0;
+    }
+
+    return stdin_len;
+}
+
+static void shell_close_input(ash_service_t *svc) {
+    /* Pty cannot be closed without losing output, keep it open */
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (svc->write_queued > 0) {
+        /* Closed once queued input is written */
+        return;
+    }
+#endif
+
+    if (svc->input_eof && svc->raw &&
+        !uv_is_closing((uv_handle_t*)&svc->input_pipe)) {
+        uv_close((uv_handle_t*)&svc->input_pipe, NULL);
+    }
+}
+#endif
+
+static void shell_after_write(uv_write_t* req, int status) {
+    apacket_uv_t *up = container_of(req, apacket_uv_t, wr);
+    ash_service_t *svc = (ash_service_t*)req->data;
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+
+    svc->write_pending -= 1;
+    if (uv_is_closing((uv_handle_t*)&svc->shell_pipe)) {
+        /* Write cancelled by close, client may be gone already */
+        free(up);
+        return;
+    }
+
+    if (status < 0) {
+        adb_err("uv_write failed %d\n", status);
+        adb_service_close(&client->client, &svc->service, &up->p);
+        return;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    shell_close_input(svc);
+#endif
+
+    /* Write frame processing done, send acknowledge frame */
+    adb_send_okay_frame(&client->client, &up->p,
+        svc->service.id, svc->service.peer_id);
+}
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+static void shell_after_queued_write(uv_write_t* req, int status) {
+    apacket_uv_t *up = container_of(req, apacket_uv_t, wr);
+    ash_service_t *svc = (ash_service_t*)req->data;
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+
+    svc->write_queued -= up->p.write_len;
+    svc->write_pending -= 1;
+    if (uv_is_closing((uv_handle_t*)&svc->shell_pipe)) {
+        /* Write cancelled by close, client may be gone already */
+        free(up);
+        return;
+    }
+
+    if (status < 0) {
+        adb_err("uv_write failed %d\n", status);
+        adb_service_close(&client->client, &svc->service, &up->p);
+        return;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    shell_close_input(svc);
+#endif
+
+    /* Frame was acknowledged once queued */
+    adb_hal_apacket_release(&client->client, &up->p);
+}
+#endif
+
+static int shell_write(adb_service_t *service, apacket *p) {
+    int ret;
+    uv_buf_t buf;
+    uv_stream_t *stream;
+
+    apacket_uv_t *up = container_of(p, apacket_uv_t, p);
+    ash_service_t *svc = container_of(service, ash_service_t, service);
+
+    buf = uv_buf_init((char*)&p->data, p->msg.data_length);
+    up->wr.data = svc;
+    stream = (uv_stream_t*)&svc->shell_pipe;
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    if (svc->raw) {
+        stream = (uv_stream_t*)&svc->input_pipe;
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->v2) {
+        buf.len = shell_parse_input(svc, p->data, buf.len);
+        if (buf.len == 0) {
+            /* No stdin content */
+            shell_close_input(svc);
+            return 0;
+        }
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    if (stream == (uv_stream_t*)&svc->shell_pipe) {
+        /* Next output is likely an echo of this input */
+        svc->echo = 1;
+    }
+#endif
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (svc->write_queued + buf.len <= CONFIG_ADBD_WRITE_BUDGET) {
+        adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+        apacket *okay = adb_hal_apacket_allocate(&client->client);
+
+        /* Acknowledge now so that host sends next frame while this one
+         * is written. Otherwise ack is deferred until write is done. */
+
+        if (okay != NULL) {
+            ret = uv_write(&up->wr, stream, &buf, 1,
+                           shell_after_queued_write);
+            if (ret) {
+                adb_err("uv_write failed %d %d\n", ret, errno);
+                adb_hal_apacket_release(&client->client, okay);
+                return -1;
+            }
+
+            p->write_len = buf.len;
+            svc->write_queued += buf.len;
+            svc->write_pending += 1;
+            adb_send_okay_frame(&client->client, okay,
+                svc->service.id, svc->service.peer_id);
+            return 1;
+        }
+    }
+#endif
+
+    ret = uv_write(&up->wr, stream, &buf, 1, shell_after_write);
+    if (ret) {
+        adb_err("uv_write failed %d %d\n", ret, errno);
+        return -1;
+    }
+
+    svc->write_pending += 1;
+
+    /* Notify ADB client that packet is now managed by service */
+    return 1;
+}
+
+static int shell_ack(adb_service_t *service, apacket *p) {
+    ash_service_t *svc = container_of(service, ash_service_t, service);
+    UNUSED(p);
+
+    svc->wait_ack = 0;
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    svc->unacked_len = 0;
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (svc->exit_sent) {
+        /* Shell session is over */
+        return -1;
+    }
+#endif
+
+    if (svc->eof) {
+        /* Read fails if pipe was closed on error */
+        svc->eof = 0;
+        if (uv_read_start((uv_stream_t*)&svc->shell_pipe,
+                alloc_buffer, pipe_on_data_available)) {
+#ifdef CONFIG_ADBD_SHELL_V2
+            if (svc->v2) {
+                svc->output_done = 1;
+                shell_kick(service);
+                return 0;
+            }
+#endif
+            return -1;
+        }
+    }
+
+    shell_kick(service);
+    return 0;
+}
+
+static void shell_kick(adb_service_t *service) {
+    ash_service_t *svc = container_of(service, ash_service_t, service);
+
+    if (svc->wait_ack) {
+        return;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (shell_send_exit(svc)) {
+        return;
+    }
+
+    if (svc->error_open &&
+        !uv_is_active((uv_handle_t*)&svc->error_pipe)) {
+        uv_read_start((uv_stream_t*)&svc->error_pipe,
+            error_alloc_buffer, error_on_data_available);
+    }
+
+    if (svc->output_done) {
+        return;
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    if (svc->replay != NULL) {
+        /* Output buffered while detached goes first */
+        shell_replay(svc);
+        if (svc->replay != NULL || svc->wait_ack) {
+            return;
+        }
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    if (svc->splice_fd >= 0) {
+        if (!uv_is_active((uv_handle_t*)&svc->splice_poll)) {
+            uv_poll_start(&svc->splice_poll, UV_READABLE, shell_on_splice);
+        }
+        return;
+    }
+#endif
+
+    if (!uv_is_active((uv_handle_t*)&svc->shell_pipe)) {
+#ifdef CONFIG_ADBD_SHELL_SESSION
+        uv_buf_t buf;
+
+        if (uv_read_start((uv_stream_t*)&svc->shell_pipe,
+                alloc_buffer, pipe_on_data_available) &&
+            svc->session[0] != 0) {
+            /* Pipe failed while session was detached, end of output
+             * is reported now */
+            shell_alloc(svc, &buf);
+            if (buf.base != NULL) {
+                pipe_on_data_available((uv_stream_t*)&svc->shell_pipe,
+                                       UV_EIO, &buf);
+            }
+        }
+#else
+        /* No need to check return code as it would only fail when
+         * in case the pipe fd is closing */
+        uv_read_start((uv_stream_t*)&svc->shell_pipe,
+            alloc_buffer, pipe_on_data_available);
+#endif
+    }
+}
+
+#ifdef CONFIG_ADBD_SHELL_VFORK
+static void shell_close_process(ash_service_t *svc) {
+    if (svc->pid > 0) {
+        /* Child was killed on close, wait for it */
+        svc->closed = 1;
+        return;
+    }
+
+    free(svc);
+}
+#else
+static void shell_close_process_callback(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void shell_close_process(ash_service_t *svc) {
+    uv_close((uv_handle_t *)&svc->process, shell_close_process_callback);
+}
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+static void shell_close_timer_callback(uv_handle_t *handle) {
+    shell_close_process(container_of(handle, ash_service_t, timer));
+}
+#endif
+
+static void shell_close_pipe_callback(uv_handle_t *handle) {
+    ash_service_t *svc = container_of(handle, ash_service_t, shell_pipe);
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    uv_close((uv_handle_t *)&svc->timer, shell_close_timer_callback);
+#else
+    shell_close_process(svc);
+#endif
+}
+
+static void shell_close(adb_service_t *service) {
+  ash_service_t *svc = container_of(service, ash_service_t, service);
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+  if (!shell_session_detach(svc)) {
+      return;
+  }
+
+  shell_session_remove(svc);
+#endif
+
+  /* Terminate child process in case it is still running */
+
+#ifdef CONFIG_ADBD_SHELL_VFORK
+  if (svc->pid > 0) {
+      kill(svc->pid, SIGKILL);
+  }
+#else
+  uv_process_kill(&svc->process, SIGKILL);
+#endif
+
+  if (svc->packet != NULL) {
+      /* Drop output not sent yet */
+      adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+      adb_hal_apacket_release(&client->client, svc->packet);
+      svc->packet = NULL;
+  }
+
+  if (svc->write_pending > 0) {
+      adb_uv_packet_disown((adb_client_uv_t *)svc->shell_pipe.data,
+                           svc->write_pending);
+  }
+
+  /* Other pipes are closed before process handle, service is freed
+   * after it */
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+  if (svc->raw && !uv_is_closing((uv_handle_t *)&svc->input_pipe)) {
+      uv_close((uv_handle_t *)&svc->input_pipe, NULL);
+  }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_V2
+  if (svc->error_open) {
+      uv_close((uv_handle_t *)&svc->error_pipe, NULL);
+  }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+  if (svc->ctl_fd >= 0) {
+      close(svc->ctl_fd);
+  }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+  if (svc->splice_fd >= 0) {
+      /* Poll handle is stopped at once, fd can be closed */
+      uv_close((uv_handle_t *)&svc->splice_poll, NULL);
+      close(svc->splice_fd);
+  }
+#endif
+
+  uv_close((uv_handle_t *)&svc->shell_pipe, shell_close_pipe_callback);
+}
+
+static const adb_service_ops_t shell_ops = {
+  .on_write_frame = shell_write,
+  .on_ack_frame   = shell_ack,
+  .on_kick        = shell_kick,
+  .on_close       = shell_close
+};
+
+static ash_service_t *shell_new(adb_client_t *client) {
+    ash_service_t *service =
+        (ash_service_t *)malloc(sizeof(ash_service_t));
+
+    if (service == NULL) {
+        return NULL;
+    }
+
+    service->service.ops = &shell_ops;
+    service->shell_pipe.data = client;
+#ifdef CONFIG_ADBD_SHELL_VFORK
+    service->pid = 0;
+    service->closed = 0;
+#else
+    service->process.data = service;
+#endif
+    service->wait_ack = 0;
+    service->write_pending = 0;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    service->write_queued = 0;
+#endif
+    service->packet = NULL;
+    service->eof = 0;
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    service->echo = 0;
+#endif
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    service->raw = 0;
+#endif
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    service->splice_fd = -1;
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    service->v2 = 0;
+    service->exit_code = -1;
+    service->output_done = 0;
+    service->exit_sent = 0;
+    service->input_eof = 0;
+    service->error_open = 0;
+    service->in_hdr_len = 0;
+    service->in_left = 0;
+#endif
+#ifdef CONFIG_ADBD_SHELL_POOL
+    service->pool_next = NULL;
+    service->ctl_fd = -1;
+    service->pooled = 0;
+#endif
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    service->session_next = NULL;
+    service->session[0] = 0;
+    service->detached = 0;
+    service->detach_seq = 0;
+    service->exited = 0;
+    service->replay = NULL;
+    service->replay_head = 0;
+    service->replay_len = 0;
+    service->unacked = NULL;
+    service->unacked_len = 0;
+#endif
+    return service;
+}
+
+static int shell_spawn(ash_service_t *service, uv_loop_t *loop,
+                       char **argv, int interactive) {
+    int ret;
+    uv_process_options_t options;
+    uv_stdio_container_t stdio[4];
+    struct termios slavetermios;
+    char *slavedevice = NULL;
+    int fds[2];
+    int in_fd;
+    int err_fd;
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    int in_fds[2] = { -1, -1 };
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    int err_fds[2] = { -1, -1 };
+#endif
+#ifdef CONFIG_ADBD_SHELL_POOL
+    int ctl_fds[2] = { -1, -1 };
+#endif
+
+    memset(&options, 0, sizeof(options));
+    memset(stdio, 0, sizeof(stdio));
+
+    options.stdio_count = 3;
+    options.stdio = stdio;
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    if (service->raw) {
+        /* Setup IPC to communicate with child process over pipes,
+         * stderr is merged with stdout unless shell protocol is used */
+
+        if (shell_open_pipe(fds)) {
+            return -1;
+        }
+
+        if (shell_open_pipe(in_fds)) {
+            goto exit_close_fd1;
+        }
+
+        ret = uv_pipe_init(loop, &service->input_pipe, 0);
+        if (ret) {
+            goto exit_close_fd1;
+        }
+
+        ret = uv_pipe_open(&service->input_pipe, in_fds[1]);
+        if (ret) {
+            goto exit_close_fd1;
+        }
+
+        in_fd = in_fds[0];
+        err_fd = fds[1];
+
+#ifdef CONFIG_ADBD_SHELL_V2
+        if (service->v2) {
+            if (shell_open_pipe(err_fds)) {
+                goto exit_close_fd1;
+            }
+
+            ret = uv_pipe_init(loop, &service->error_pipe, 0);
+            if (ret) {
+                goto exit_close_fd1;
+            }
+
+            ret = uv_pipe_open(&service->error_pipe, err_fds[0]);
+            if (ret) {
+                goto exit_close_fd1;
+            }
+
+            service->error_open = 1;
+            err_fd = err_fds[1];
+        }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+        if (service->pooled) {
+            /* Command is read from fd 3 once shell is taken from pool */
+
+            if (shell_open_pipe(ctl_fds)) {
+                goto exit_close_fd1;
+            }
+
+            options.stdio_count = 4;
+            stdio[3].flags = UV_INHERIT_FD;
+            stdio[3].data.fd = ctl_fds[0];
+        }
+#endif
+        goto open_pipe;
+    }
+#endif
+
+    /* Setup IPC to communicate with child shell process.
+     * Create interactive session based on pty */
+
+#ifdef O_CLOEXEC
+    fds[0] = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+#else
+    fds[0] = posix_openpt(O_RDWR | O_NOCTTY);
+#endif
+
+    if (fds[0] < 0) {
+        return -1;
+    }
+
+    if ((ret = grantpt(fds[0]))) {
+        goto exit_close_fd0;
+    }
+    if ((ret = unlockpt(fds[0]))) {
+        goto exit_close_fd0;
+    }
+
+    slavedevice = ptsname(fds[0]);
+
+#ifdef O_CLOEXEC
+    fds[1] = open(slavedevice, O_RDWR | O_NOCTTY | O_CLOEXEC);
+#else
+    fds[1] = open(slavedevice, O_RDWR | O_NOCTTY);
+#endif
+    if (fds[1] < 0) {
+        adb_err("slavefd failed (%d)\n", errno);
+        goto exit_close_fd0;
+    }
+
+#ifndef O_CLOEXEC
+    if ((ret = shell_set_cloexec(fds[0])) ||
+        (ret = shell_set_cloexec(fds[1]))) {
+        goto exit_close_fd1;
+    }
+#endif
+
+    if (!interactive) {
+        /* This is not an interactive session. Switch to RAW mode */
+
+        cfmakeraw(&slavetermios);
+        tcsetattr(fds[1], TCSADRAIN, &slavetermios);
+    }
+
+    in_fd = fds[1];
+    err_fd = fds[1];
+
+#ifdef CONFIG_ADBD_SHELL_EXEC
+open_pipe:
+#endif
+
+    /* Open pipe endpoint that is managed by adb daemon */
+
+    ret = uv_pipe_init(loop, &service->shell_pipe, 0);
+    if (ret) {
+        goto exit_close_fd1;
+    }
+
+    ret = uv_pipe_open(&service->shell_pipe, fds[0]);
+    if (ret) {
+        goto exit_close_fd1;
+    }
+
+    /* Spawn new uv_process_t to manage shell */
+
+    stdio[0].flags = UV_INHERIT_FD | UV_READABLE_PIPE;
+    stdio[0].data.fd = in_fd;
+
+    stdio[1].flags = UV_INHERIT_FD | UV_WRITABLE_PIPE;
+    stdio[1].data.fd = fds[1];
+
+    stdio[2].flags = UV_INHERIT_FD | UV_WRITABLE_PIPE;
+    stdio[2].data.fd = err_fd;
+
+#ifndef CONFIG_ADBD_SHELL_VFORK
+    options.exit_cb = on_child_exit;
+#endif
+    options.file = CONFIG_ADBD_SHELL_SERVICE_PATH;
+    options.args = argv;
+
+    /* FIXME Control-C does not work without this */
+
+    options.flags = UV_PROCESS_DETACHED;
+
+#ifdef CONFIG_ADBD_SHELL_VFORK
+    ret = shell_vfork(service, loop, &options);
+#else
+    ret = uv_spawn(loop, &service->process, &options);
+#endif
+    if (ret) {
+        adb_err("spawn failed (%s)\n", uv_strerror(ret));
+        goto exit_close_fd1;
+    }
+
+    /* Close shell child process endpoints as they are useless now */
+
+    close(fds[1]);
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    if (service->raw) {
+        close(in_fds[0]);
+    }
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (service->error_open) {
+        close(err_fds[1]);
+    }
+#endif
+#ifdef CONFIG_ADBD_SHELL_POOL
+    if (service->pooled) {
+        close(ctl_fds[0]);
+        service->ctl_fd = ctl_fds[1];
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    uv_timer_init(loop, &service->timer);
+#endif
+    return 0;
+
+exit_close_fd1:
+#ifdef CONFIG_ADBD_SHELL_POOL
+    if (ctl_fds[0] >= 0) {
+        close(ctl_fds[0]);
+        close(ctl_fds[1]);
+    }
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (err_fds[0] >= 0) {
+        close(err_fds[0]);
+        close(err_fds[1]);
+    }
+#endif
+#ifdef CONFIG_ADBD_SHELL_EXEC
+    if (in_fds[0] >= 0) {
+        close(in_fds[0]);
+        close(in_fds[1]);
+    }
+#endif
+    close(fds[1]);
+exit_close_fd0:
+    close(fds[0]);
+    return -1;
+}
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+static void shell_pool_fill(uv_timer_t *timer) {
+    ash_service_t *svc;
+    static char *argv[] = {
+        CONFIG_ADBD_SHELL_SERVICE_CMD, "-c", ". /dev/fd/3", NULL
+    };
+
+    if (g_shell_pool_count >= CONFIG_ADBD_SHELL_POOL) {
+        return;
+    }
+
+    /* Idle shells are spawned with shell protocol pipes, as used by
+     * adb for non interactive commands */
+
+    svc = shell_new(NULL);
+    if (svc == NULL) {
+        return;
+    }
+
+    svc->raw = 1;
+#ifdef CONFIG_ADBD_SHELL_V2
+    svc->v2 = 1;
+#endif
+    svc->pooled = 1;
+
+    if (shell_spawn(svc, timer->loop, argv, 0)) {
+        free(svc);
+        return;
+    }
+
+    svc->pool_next = g_shell_pool;
+    g_shell_pool = svc;
+    g_shell_pool_count += 1;
+
+    /* One shell at a time to keep latency of other services */
+
+    shell_pool_schedule(timer->loop);
+}
+
+static void shell_pool_schedule(uv_loop_t *loop) {
+    if (g_shell_pool_timer.loop == NULL) {
+        uv_timer_init(loop, &g_shell_pool_timer);
+        uv_unref((uv_handle_t*)&g_shell_pool_timer);
+    }
+
+    if (g_shell_pool_count < CONFIG_ADBD_SHELL_POOL &&
+        !uv_is_active((uv_handle_t*)&g_shell_pool_timer)) {
+        uv_timer_start(&g_shell_pool_timer, shell_pool_fill,
+                       SHELL_POOL_FILL_DELAY_MS, 0);
+    }
+}
+
+static void shell_pool_remove(ash_service_t *svc) {
+    ash_service_t **cur = &g_shell_pool;
+
+    while (*cur != NULL) {
+        if (*cur == svc) {
+            *cur = svc->pool_next;
+            g_shell_pool_count -= 1;
+            break;
+        }
+        cur = &(*cur)->pool_next;
+    }
+
+    svc->pooled = 0;
+}
+
+static int shell_pool_send(ash_service_t *svc, const char *cmd) {
+    struct iovec iov[4];
+    ssize_t len = 0;
+    int i, cnt = 0;
+    int ret;
+
+    /* Shell sources command until end of control pipe */
+
+    iov[cnt].iov_base = "exec 3<&-\n";
+    iov[cnt++].iov_len = 10;
+
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (!svc->v2) {
+        /* Merge stderr in stdout as expected by raw mode */
+        iov[cnt].iov_base = "exec 2>&1\n";
+        iov[cnt++].iov_len = 10;
+    }
+#endif
+
+    iov[cnt].iov_base = (char*)cmd;
+    iov[cnt++].iov_len = strlen(cmd);
+    iov[cnt].iov_base = "\n";
+    iov[cnt++].iov_len = 1;
+
+    for (i = 0; i < cnt; i++) {
+        len += iov[i].iov_len;
+    }
 
-static void alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf);
-static void pipe_on_data_available(uv_stream_t* stream, ssize_t nread,
-                                   const uv_buf_t* buf);
+    ret = writev(svc->ctl_fd, iov, cnt) == len ? 0 : -1;
+    close(svc->ctl_fd);
+    svc->ctl_fd = -1;
+    return ret;
+}
 
-static int shell_write(adb_service_t *service, apacket *p);
-static void shell_after_write(uv_write_t* req, int status);
+static ash_service_t *shell_pool_take(adb_client_t *client,
+                                      ash_service_t *req, const char *cmd) {
+    ash_service_t *svc;
 
-static int shell_ack(adb_service_t *service, apacket *p);
-static void shell_close(struct adb_service_s *service);
-static void shell_kick(adb_service_t *service);
+    shell_pool_schedule(adb_uv_get_client_handle(client)->loop);
 
-/****************************************************************************
- * Private Functions
- ****************************************************************************/
+    while ((svc = g_shell_pool) != NULL) {
+        shell_pool_remove(svc);
+        svc->shell_pipe.data = client;
+#ifdef CONFIG_ADBD_SHELL_V2
+        svc->v2 = req->v2;
+#endif
 
-#ifndef O_CLOEXEC
-static int shell_set_cloexec(int fd) {
-    int ret;
+        if (!shell_pool_send(svc, cmd)) {
+            break;
+        }
 
-    if ((ret = fcntl(fd, F_GETFD)) < 0) {
-        return ret;
+        /* Shell exited while idle */
+        shell_close(&svc->service);
     }
 
-    ret = ret | FD_CLOEXEC;
+    UNUSED(req);
+    if (svc == NULL) {
+        return NULL;
+    }
 
-    if ((ret = fcntl(fd, F_SETFD, ret)) < 0) {
-        return ret;
+#ifdef CONFIG_ADBD_SHELL_V2
+    if (!svc->v2) {
+        svc->error_open = 0;
+        uv_close((uv_handle_t*)&svc->error_pipe, NULL);
     }
+#endif
 
-    return 0;
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    shell_splice_setup(svc, adb_uv_get_client_handle(client)->loop);
+#endif
+
+    /* Start waiting for data from shell process */
+
+    shell_kick(&svc->service);
+    return svc;
 }
 #endif
 
-static void on_child_exit(uv_process_t *process, int64_t exit_status,
-        int term_signal) {
-    ash_service_t *svc = (ash_service_t*)process->data;
+#ifdef CONFIG_ADBD_SHELL_SESSION
+static ash_service_t *shell_session_find(const char *token) {
+    ash_service_t *svc;
 
-    adb_log("shell %d<->%d exited with status %ld, signal %d\n",
-        svc->service.id, svc->service.peer_id,
-        exit_status, term_signal);
+    for (svc = g_shell_sessions; svc != NULL; svc = svc->session_next) {
+        if (!strcmp(svc->session, token)) {
+            return svc;
+        }
+    }
+
+    return NULL;
 }
 
-static void alloc_buffer(uv_handle_t *handle, size_t len, uv_buf_t *buf) {
-    UNUSED(len);
-    apacket_uv_t *ap;
-    ash_service_t *service = container_of(handle, ash_service_t, shell_pipe);
-    adb_client_uv_t *client = (adb_client_uv_t *)service->shell_pipe.data;
+static void shell_session_remove(ash_service_t *svc) {
+    ash_service_t **cur = &g_shell_sessions;
 
-    assert(service->wait_ack == 0);
+    if (svc->session[0] == 0) {
+        return;
+    }
 
-    ap = adb_uv_packet_allocate(client, 0);
-    if (ap == NULL) {
-      buf->base = NULL;
-      return;
+    while (*cur != NULL) {
+        if (*cur == svc) {
+            *cur = svc->session_next;
+            break;
+        }
+        cur = &(*cur)->session_next;
+    }
+
+    if (svc->detached) {
+        g_shell_sessions_detached -= 1;
+        svc->detached = 0;
     }
 
-    buf->base = (char*)ap->p.data;
-    buf->len = CONFIG_ADBD_PAYLOAD_SIZE;
+    svc->session[0] = 0;
+    free(svc->replay);
+    svc->replay = NULL;
+    free(svc->unacked);
+    svc->unacked = NULL;
 }
 
-static void pipe_on_data_available(uv_stream_t* stream, ssize_t nread,
-        const uv_buf_t* buf) {
-    ash_service_t *service = container_of(stream, ash_service_t, shell_pipe);
-    adb_client_uv_t *client = (adb_client_uv_t *)service->shell_pipe.data;
-    apacket *p;
+static int shell_session_detach(ash_service_t *svc) {
+    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+    ash_service_t *cur;
+    ash_service_t *oldest = NULL;
 
-    if (nread == UV_ENOBUFS) {
-        /* No frame available, stop read events for now */
-        uv_read_stop((uv_stream_t*)&service->shell_pipe);
-        return;
+    /* Session is only kept when transport is lost. Pending input
+     * writes still refer to frames of lost client. */
+
+    if (svc->session[0] == 0 || svc->detached || svc->exited ||
+        svc->write_pending > 0 || client->client.is_connected) {
+        return -1;
     }
 
-    p = container_of(buf->base, apacket, data);
+    if (svc->replay == NULL) {
+        svc->replay = (uint8_t*)malloc(CONFIG_ADBD_SHELL_SESSION);
+        if (svc->replay == NULL) {
+            return -1;
+        }
+        svc->replay_head = 0;
+        svc->replay_len = 0;
+    }
 
-    if (nread <= 0) {
-        if (nread != UV_EOF) {
-            adb_err("closing due to error: %d\n", nread);
+    if (g_shell_sessions_detached >= SHELL_SESSION_MAX) {
+        for (cur = g_shell_sessions; cur != NULL; cur = cur->session_next) {
+            if (cur->detached && (oldest == NULL ||
+                (int)(cur->detach_seq - oldest->detach_seq) < 0)) {
+                oldest = cur;
+            }
         }
-        adb_service_close(&client->client, &service->service, p);
-        return;
+
+        shell_close(&oldest->service);
     }
 
-    /* Wait for ACK before processing next frame from shell */
+    adb_log("shell %d<->%d detached from session %s\n",
+        svc->service.id, svc->service.peer_id, svc->session);
 
-    service->wait_ack = 1;
-    uv_read_stop((uv_stream_t*)&service->shell_pipe);
+    /* Output host may not have received is older than any output
+     * left in ring */
 
-    p->write_len = nread;
-    p->msg.arg0 = service->service.id;
-    p->msg.arg1 = service->service.peer_id;
-    adb_send_data_frame(&client->client, p);
+    if (svc->packet != NULL) {
+        session_replay_prepend(svc, svc->packet->data,
+            session_copy_output(svc, svc->packet->data, svc->packet->data,
+                                svc->packet->write_len));
+        adb_hal_apacket_release(&client->client, svc->packet);
+        svc->packet = NULL;
+    }
+
+    if (svc->wait_ack) {
+        session_replay_prepend(svc, svc->unacked, svc->unacked_len);
+    }
+    svc->unacked_len = 0;
+
+#ifdef CONFIG_ADBD_SHELL_COALESCE_MS
+    uv_timer_stop(&svc->timer);
+    svc->echo = 0;
+#endif
+#ifdef CONFIG_ADBD_SHELL_V2
+    svc->in_hdr_len = 0;
+    svc->in_left = 0;
+#endif
+
+    svc->wait_ack = 0;
+    svc->eof = 0;
+    svc->detached = 1;
+    svc->detach_seq = g_shell_sessions_seq++;
+    svc->shell_pipe.data = NULL;
+    g_shell_sessions_detached += 1;
+
+    /* Keep reading so that shell does not block on output */
+
+    uv_read_stop((uv_stream_t*)&svc->shell_pipe);
+    uv_read_start((uv_stream_t*)&svc->shell_pipe,
+        session_alloc_buffer, session_on_data_available);
+    return 0;
 }
 
-static void shell_after_write(uv_write_t* req, int status) {
-    apacket_uv_t *up = container_of(req, apacket_uv_t, wr);
-    ash_service_t *svc = (ash_service_t*)req->data;
-    adb_client_uv_t *client = (adb_client_uv_t *)svc->shell_pipe.data;
+static void shell_session_attach(ash_service_t *svc, adb_client_t *client,
+                                 ash_service_t *req) {
+    adb_log("session %s reattached\n", svc->session);
 
-    if (status < 0) {
-        adb_err("uv_write failed %d\n", status);
-        adb_service_close(&client->client, &svc->service, &up->p);
-        return;
+    uv_read_stop((uv_stream_t*)&svc->shell_pipe);
+    if (svc->replay_len == 0) {
+        free(svc->replay);
+        svc->replay = NULL;
     }
 
-    /* Write frame processing done, send acknowledge frame */
-    adb_send_okay_frame(&client->client, &up->p,
-        svc->service.id, svc->service.peer_id);
+    svc->detached = 0;
+    svc->shell_pipe.data = client;
+    g_shell_sessions_detached -= 1;
+#ifdef CONFIG_ADBD_SHELL_V2
+    /* Host may reconnect with another protocol version */
+    svc->v2 = req->v2;
+#else
+    UNUSED(req);
+#endif
+
+    /* Replay is started on kick once open is acknowledged */
 }
 
-static int shell_write(adb_service_t *service, apacket *p) {
-    int ret;
+static void shell_replay(ash_service_t *svc) {
     uv_buf_t buf;
+    size_t len;
 
-    apacket_uv_t *up = container_of(p, apacket_uv_t, p);
-    ash_service_t *svc = container_of(service, ash_service_t, service);
+    while (svc->replay_len > 0 && !svc->wait_ack) {
+        shell_alloc(svc, &buf);
+        if (buf.base == NULL) {
+            /* Resumed on next kick */
+            return;
+        }
 
-    buf = uv_buf_init((char*)&p->data, p->msg.data_length);
-    up->wr.data = svc;
+        len = CONFIG_ADBD_SHELL_SESSION - svc->replay_head;
+        len = len < svc->replay_len ? len : svc->replay_len;
+        len = len < buf.len ? len : buf.len;
 
-    ret = uv_write(&up->wr, (uv_stream_t*)&svc->shell_pipe, &buf, 1,
-        shell_after_write);
-    if (ret) {
-        adb_err("uv_write failed %d %d\n", ret, errno);
-        return -1;
+        memcpy(buf.base, &svc->replay[svc->replay_head], len);
+        svc->replay_head = (svc->replay_head + len) %
+                           CONFIG_ADBD_SHELL_SESSION;
+        svc->replay_len -= len;
+
+        shell_output(svc, SHELL_V2_STDOUT, len);
     }
 
-    /* Notify ADB client that packet is now managed by service */
-    return 1;
+    if (svc->replay_len == 0) {
+        free(svc->replay);
+        svc->replay = NULL;
+    }
 }
 
-static int shell_ack(adb_service_t *service, apacket *p) {
-    ash_service_t *svc = container_of(service, ash_service_t, service);
-    UNUSED(p);
+static size_t session_copy_output(ash_service_t *svc, uint8_t *dst,
+                                  const uint8_t *src, size_t len) {
+#ifdef CONFIG_ADBD_SHELL_V2
+    size_t out = 0;
+    size_t chunk;
+
+    if (svc->v2) {
+        /* Ring holds output only, packet headers are dropped */
+
+        while (len > SHELL_V2_HDR_SIZE) {
+            chunk = src[1] | (src[2] << 8) | (src[3] << 16) |
+                    ((size_t)src[4] << 24);
+            src += SHELL_V2_HDR_SIZE;
+            len -= SHELL_V2_HDR_SIZE;
+            chunk = chunk < len ? chunk : len;
+
+            memmove(&dst[out], src, chunk);
+            out += chunk;
+            src += chunk;
+            len -= chunk;
+        }
 
-    svc->wait_ack = 0;
-    shell_kick(service);
-    return 0;
+        return out;
+    }
+#else
+    UNUSED(svc);
+#endif
+
+    memmove(dst, src, len);
+    return len;
 }
 
-static void shell_kick(adb_service_t *service) {
-    ash_service_t *svc = container_of(service, ash_service_t, service);
+static void session_replay_prepend(ash_service_t *svc, const uint8_t *data,
+                                   size_t len) {
+    size_t room = CONFIG_ADBD_SHELL_SESSION - svc->replay_len;
+    size_t chunk;
 
-    if (!svc->wait_ack) {
-        if (!uv_is_active((uv_handle_t*)&svc->shell_pipe)) {
-            /* No need to check return code as it would only fail when
-             * in case the pipe fd is closing */
-            uv_read_start((uv_stream_t*)&svc->shell_pipe,
-                alloc_buffer, pipe_on_data_available);
-        }
+    /* Ring keeps newest output, start of data is dropped if needed */
+
+    if (len > room) {
+        data += len - room;
+        len = room;
     }
-}
 
-static void shell_close_process_callback(uv_handle_t *handle) {
-    free(handle->data);
+    while (len > 0) {
+        chunk = svc->replay_head > 0 ? svc->replay_head :
+                CONFIG_ADBD_SHELL_SESSION;
+        chunk = chunk < len ? chunk : len;
+
+        svc->replay_head = (svc->replay_head + CONFIG_ADBD_SHELL_SESSION -
+                            chunk) % CONFIG_ADBD_SHELL_SESSION;
+        memcpy(&svc->replay[svc->replay_head], &data[len - chunk], chunk);
+        svc->replay_len += chunk;
+        len -= chunk;
+    }
 }
 
-static void shell_close_pipe_callback(uv_handle_t *handle) {
+static void session_alloc_buffer(uv_handle_t *handle, size_t len,
+                                 uv_buf_t *buf) {
     ash_service_t *svc = container_of(handle, ash_service_t, shell_pipe);
-    uv_close((uv_handle_t *)&svc->process, shell_close_process_callback);
+    size_t tail;
+
+    UNUSED(len);
+
+    /* Oldest output is overwritten once ring is full */
+
+    tail = (svc->replay_head + svc->replay_len) % CONFIG_ADBD_SHELL_SESSION;
+    buf->base = (char*)&svc->replay[tail];
+    buf->len = CONFIG_ADBD_SHELL_SESSION - tail;
 }
 
-static void shell_close(adb_service_t *service) {
-  ash_service_t *svc = container_of(service, ash_service_t, service);
+static void session_on_data_available(uv_stream_t* stream, ssize_t nread,
+                                      const uv_buf_t* buf) {
+    ash_service_t *svc = container_of(stream, ash_service_t, shell_pipe);
 
-  /* Terminate child process in case it is still running */
+    UNUSED(buf);
 
-  uv_process_kill(&svc->process, SIGKILL);
+    if (nread < 0) {
+        /* End of output is reported once host reattaches */
+        uv_read_stop(stream);
+        return;
+    }
 
-  uv_close((uv_handle_t *)&svc->shell_pipe, shell_close_pipe_callback);
+    svc->replay_len += nread;
+    if (svc->replay_len > CONFIG_ADBD_SHELL_SESSION) {
+        svc->replay_head = (svc->replay_head + svc->replay_len -
+                            CONFIG_ADBD_SHELL_SESSION) %
+                           CONFIG_ADBD_SHELL_SESSION;
+        svc->replay_len = CONFIG_ADBD_SHELL_SESSION;
+    }
 }
-
-static const adb_service_ops_t shell_ops = {
-  .on_write_frame = shell_write,
-  .on_ack_frame   = shell_ack,
-  .on_kick        = shell_kick,
-  .on_close       = shell_close
-};
+#endif
 
 /****************************************************************************
  * Public Functions
@@ -239,25 +2080,46 @@ adb_service_t *shell_service(adb_client_t *client, const char *params) {
     int ret;
     char **argv;
     const char *target_cmd;
-    uv_process_options_t options;
-    uv_stdio_container_t stdio[3];
-    struct termios slavetermios;
-    char *slavedevice = NULL;
-    int fds[2];
-
-    ash_service_t *service =
-        (ash_service_t *)malloc(sizeof(ash_service_t));
+    ash_service_t *service;
 
+    service = shell_new(client);
     if (service == NULL) {
         return NULL;
     }
 
-    service->service.ops = &shell_ops;
-    service->shell_pipe.data = client;
-    service->process.data = service;
-    service->wait_ack = 0;
+    target_cmd = shell_parse_params(service, params);
+    if (target_cmd == NULL) {
+        goto exit_free_service;
+    }
+
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    if (service->session[0] != 0) {
+        ash_service_t *session = shell_session_find(service->session);
+
+        if (session != NULL) {
+            if (!session->detached) {
+                adb_err("session %s in use\n", service->session);
+                goto exit_free_service;
+            }
+
+            /* Command is ignored, shell is already running */
+            shell_session_attach(session, client, service);
+            free(service);
+            return &session->service;
+        }
+    }
+#endif
+
+#ifdef CONFIG_ADBD_SHELL_POOL
+    if (service->raw && target_cmd[0] != 0) {
+        ash_service_t *pooled = shell_pool_take(client, service, target_cmd);
 
-    target_cmd = &params[sizeof(ADB_SHELL_PREFIX)-1];
+        if (pooled != NULL) {
+            free(service);
+            return &pooled->service;
+        }
+    }
+#endif
 
     /* Setup child process argv */
 
@@ -307,113 +2169,34 @@ adb_service_t *shell_service(adb_client_t *client, const char *params) {
 
     strcpy(argv[0], CONFIG_ADBD_SHELL_SERVICE_CMD);
 
-    /* Setup IPC to communicate with child shell process.
-     * Create interactive session based on pty */
+    ret = shell_spawn(service, adb_uv_get_client_handle(client)->loop,
+                      argv, target_cmd[0] == 0);
 
-#ifdef O_CLOEXEC
-    fds[0] = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
-#else
-    fds[0] = posix_openpt(O_RDWR | O_NOCTTY);
-#endif
+    /* argv array is useless now */
 
-    if (fds[0] < 0) {
-        goto exit_free_argv;
-    }
+    free(argv);
 
-    if ((ret = grantpt(fds[0]))) {
-        goto exit_close_fd0;
-    }
-    if ((ret = unlockpt(fds[0]))) {
-        goto exit_close_fd0;
+    if (ret) {
+        goto exit_free_service;
     }
 
-    slavedevice = ptsname(fds[0]);
-
-#ifdef O_CLOEXEC
-    fds[1] = open(slavedevice, O_RDWR | O_NOCTTY | O_CLOEXEC);
-#else
-    fds[1] = open(slavedevice, O_RDWR | O_NOCTTY);
+#ifdef CONFIG_ADBD_SHELL_SPLICE
+    shell_splice_setup(service, adb_uv_get_client_handle(client)->loop);
 #endif
-    if (fds[1] < 0) {
-        adb_err("slavefd failed (%d)\n", errno);
-        goto exit_close_fd0;
-    }
 
-#ifndef O_CLOEXEC
-    if ((ret = shell_set_cloexec(fds[0])) ||
-        (ret = shell_set_cloexec(fds[1]))) {
-        goto exit_close_fd1;
+#ifdef CONFIG_ADBD_SHELL_SESSION
+    if (service->session[0] != 0) {
+        service->session_next = g_shell_sessions;
+        g_shell_sessions = service;
     }
 #endif
 
-    if (target_cmd[0] != 0) {
-        /* This is not an interactive session. Switch to RAW mode */
-
-        cfmakeraw(&slavetermios);
-        tcsetattr(fds[1], TCSADRAIN, &slavetermios);
-    }
-
-    /* Open pipe endpoint that is managed by adb daemon */
-
-    ret = uv_pipe_init(adb_uv_get_client_handle(client)->loop,
-                       &service->shell_pipe, 0);
-    if (ret) {
-        goto exit_close_fd1;
-    }
-
-    ret = uv_pipe_open(&service->shell_pipe, fds[0]);
-    if (ret) {
-        goto exit_close_fd1;
-    }
-
-    /* Spawn new uv_process_t to manage shell */
-
-    memset(&options, 0, sizeof(options));
-    memset(stdio, 0, sizeof(stdio));
-
-    options.stdio_count = 3;
-    options.stdio = stdio;
-    stdio[0].flags = UV_INHERIT_FD | UV_READABLE_PIPE;
-    stdio[0].data.fd = fds[1];
-
-    stdio[1].flags = UV_INHERIT_FD | UV_WRITABLE_PIPE;
-    stdio[1].data.fd = fds[1];
-
-    stdio[2].flags = UV_INHERIT_FD | UV_WRITABLE_PIPE;
-    stdio[2].data.fd = fds[1];
-
-    options.exit_cb = on_child_exit;
-    options.file = CONFIG_ADBD_SHELL_SERVICE_PATH;
-    options.args = argv;
-
-    /* FIXME Control-C does not work without this */
-
-    options.flags = UV_PROCESS_DETACHED;
-
-    ret = uv_spawn(service->shell_pipe.loop, &service->process, &options);
-    if (ret) {
-        adb_err("uv_spawn failed (%s)\n", uv_strerror(ret));
-        goto exit_close_fd1;
-    }
-
-    /* Close shell child process endpoint and free argv array
-     * at it is useless now */
-
-    close(fds[1]);
-    free(argv);
-
     /* Start waiting for data from shell process */
 
     shell_kick(&service->service);
 
     return &service->service;
 
-exit_close_fd1:
-    close(fds[1]);
-exit_close_fd0:
-    close(fds[0]);
-exit_free_argv:
-    free(argv);
 exit_free_service:
     free(service);
     return NULL;
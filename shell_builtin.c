@@ -0,0 +1,836 @@
+/*
+ * Copyright (C) 2020 Simon Piriou. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "adb.h"
+#include "shell_service.h"
+
+/****************************************************************************
+ * Private types
+ ****************************************************************************/
+
+/* Simple commands are run in daemon instead of spawning a shell. Command
+ * line is only accepted if a shell would not expand anything in it. Each
+ * step runs in a worker thread and fills the output buffer, which is then
+ * sent in frames from adb thread before next step is queued.
+ *
+ * Commands with a prepare callback are checked again from first step,
+ * before OPEN is acknowledged. If check fails, command is spawned and
+ * OPEN is acknowledged by shell service instead. */
+
+#define BUILTIN_ARGS     16
+#define BUILTIN_BUF_SIZE (4 * CONFIG_ADBD_PAYLOAD_SIZE)
+
+/* Characters a shell could expand or interpret */
+
+#define BUILTIN_SPECIAL  "|&;<()$`\\\"'*?[]~{}#=!\n"
+
+/* Step result */
+
+#define BUILTIN_DONE     0
+#define BUILTIN_MORE     1
+
+struct ash_builtin_s;
+
+typedef struct ash_builtin_cmd_s {
+    const char *name;
+    /* Check arguments from adb thread, command is spawned on failure */
+    int (*check)(struct ash_builtin_s *svc);
+    /* Check from worker thread before first step, same as check */
+    int (*prepare)(struct ash_builtin_s *svc);
+    /* Called from worker thread until BUILTIN_DONE is returned */
+    int (*step)(struct ash_builtin_s *svc);
+} ash_builtin_cmd_t;
+
+typedef struct ash_builtin_s {
+    adb_service_t service;
+    adb_client_t *client;
+    const ash_builtin_cmd_t *cmd;
+
+    int argc;
+    char *argv[BUILTIN_ARGS + 1];
+    /* Target of echo > file, NULL otherwise */
+    char *redirect;
+    uint8_t append;
+
+    /* Command progress */
+    int arg;
+    int fd;
+    struct dirent **entries;
+    int entries_count;
+    int entry;
+
+    uint8_t busy;
+    uint8_t done;
+    uint8_t closed;
+    uint8_t wait_ack;
+    /* OPEN acknowledged, or command to be spawned instead */
+    uint8_t opened;
+    uint8_t spawn;
+
+    /* Acknowledge frame kept while next step is running */
+    apacket *packet;
+
+    size_t out_len;
+    size_t out_pos;
+    char out[BUILTIN_BUF_SIZE];
+
+    /* Service name, kept for spawn */
+    char *name;
+
+    /* Command line, split in place, followed by service name */
+    char line[];
+} ash_builtin_t;
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static int builtin_printf(ash_builtin_t *svc, const char *fmt, ...);
+
+static int builtin_check_none(ash_builtin_t *svc);
+static int builtin_check_cat(ash_builtin_t *svc);
+static int builtin_check_echo(ash_builtin_t *svc);
+static int builtin_check_ls(ash_builtin_t *svc);
+static int builtin_check_stat(ash_builtin_t *svc);
+
+static int builtin_prepare_cat(ash_builtin_t *svc);
+
+static int builtin_cat(ash_builtin_t *svc);
+static int builtin_echo(ash_builtin_t *svc);
+static int builtin_ls(ash_builtin_t *svc);
+static int builtin_stat(ash_builtin_t *svc);
+
+static void builtin_work(void *arg);
+static void builtin_after_work(void *arg);
+
+static int builtin_write(adb_service_t *service, apacket *p);
+static int builtin_ack(adb_service_t *service, apacket *p);
+static void builtin_kick(adb_service_t *service);
+static void builtin_close(adb_service_t *service);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const ash_builtin_cmd_t g_builtin_cmds[] = {
+    { "cat",  builtin_check_cat,  builtin_prepare_cat, builtin_cat  },
+    { "echo", builtin_check_echo, NULL,                builtin_echo },
+    { "ls",   builtin_check_ls,   NULL,                builtin_ls   },
+    { "stat", builtin_check_stat, NULL,                builtin_stat },
+};
+
+static const adb_service_ops_t builtin_ops = {
+    .on_write_frame = builtin_write,
+    .on_ack_frame   = builtin_ack,
+    .on_kick        = builtin_kick,
+    .on_close       = builtin_close
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Append formatted output. Nothing is appended if it does not fit, unless
+ * buffer is empty in which case output is truncated. */
+
+static int builtin_printf(ash_builtin_t *svc, const char *fmt, ...) {
+    va_list ap;
+    size_t room = BUILTIN_BUF_SIZE - svc->out_len;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(svc->out + svc->out_len, room, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return 0;
+    }
+
+    if ((size_t)len >= room) {
+        if (svc->out_len > 0) {
+            return -1;
+        }
+        len = room - 1;
+    }
+
+    svc->out_len += len;
+    return 0;
+}
+
+static int builtin_check_none(ash_builtin_t *svc) {
+    int i;
+
+    /* Options are left to the real command */
+
+    for (i = 1; i < svc->argc; i++) {
+        if (svc->argv[i][0] == '-') {
+            return -1;
+        }
+    }
+
+    return svc->redirect == NULL ? 0 : -1;
+}
+
+static int builtin_check_cat(ash_builtin_t *svc) {
+    /* Standard input is not forwarded */
+
+    if (svc->argc < 2) {
+        return -1;
+    }
+
+    return builtin_check_none(svc);
+}
+
+static int builtin_check_echo(ash_builtin_t *svc) {
+    int i;
+
+    for (i = 1; i < svc->argc; i++) {
+        if (svc->argv[i][0] == '-' &&
+            (i > 1 || strcmp(svc->argv[i], "-n"))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int builtin_check_ls(ash_builtin_t *svc) {
+    /* Single directory listing, as header lines are not generated */
+
+    if (svc->argc > 2) {
+        return -1;
+    }
+
+    return builtin_check_none(svc);
+}
+
+static int builtin_check_stat(ash_builtin_t *svc) {
+    const char *fmt;
+
+    /* Only stat -c <format> <file...> */
+
+    if (svc->argc < 4 || strcmp(svc->argv[1], "-c") ||
+        svc->redirect != NULL) {
+        return -1;
+    }
+
+    for (fmt = svc->argv[2]; *fmt; fmt++) {
+        if (*fmt == '%' && !strchr("%nsafugXYZhi", *++fmt)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int builtin_prepare_cat(ash_builtin_t *svc) {
+    struct stat st;
+    int i;
+
+    /* Reads from devices or fifos may block worker forever, they are
+     * left to shell. Missing files are reported by builtin. */
+
+    for (i = 1; i < svc->argc; i++) {
+        if (!stat(svc->argv[i], &st) && !S_ISREG(st.st_mode)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int builtin_cat(ash_builtin_t *svc) {
+    ssize_t len;
+
+    while (svc->arg < svc->argc) {
+        if (svc->fd < 0) {
+            do {
+                svc->fd = open(svc->argv[svc->arg], O_RDONLY);
+            } while (svc->fd < 0 && errno == EINTR);
+
+            if (svc->fd < 0) {
+                if (builtin_printf(svc, "cat: %s: %s\n",
+                                   svc->argv[svc->arg], strerror(errno))) {
+                    return BUILTIN_MORE;
+                }
+                svc->arg += 1;
+                continue;
+            }
+        }
+
+        if (svc->out_len == BUILTIN_BUF_SIZE) {
+            return BUILTIN_MORE;
+        }
+
+        do {
+            len = read(svc->fd, svc->out + svc->out_len,
+                       BUILTIN_BUF_SIZE - svc->out_len);
+        } while (len < 0 && errno == EINTR);
+
+        if (len > 0) {
+            svc->out_len += len;
+            continue;
+        }
+
+        if (len < 0 && builtin_printf(svc, "cat: %s: %s\n",
+                                      svc->argv[svc->arg],
+                                      strerror(errno))) {
+            return BUILTIN_MORE;
+        }
+
+        close(svc->fd);
+        svc->fd = -1;
+        svc->arg += 1;
+    }
+
+    return BUILTIN_DONE;
+}
+
+static int builtin_echo(ash_builtin_t *svc) {
+    int i = 1;
+    int newline = 1;
+    ssize_t len = 0;
+
+    if (svc->argc > 1 && !strcmp(svc->argv[1], "-n")) {
+        newline = 0;
+        i = 2;
+    }
+
+    /* Arguments come from a single frame and always fit in buffer */
+
+    for (; i < svc->argc; i++) {
+        builtin_printf(svc, i < svc->argc - 1 ? "%s " : "%s",
+                       svc->argv[i]);
+    }
+
+    if (newline) {
+        builtin_printf(svc, "\n");
+    }
+
+    if (svc->redirect == NULL) {
+        return BUILTIN_DONE;
+    }
+
+    /* Value is written at once, as expected by sysfs attributes */
+
+    svc->fd = open(svc->redirect, O_WRONLY | O_CREAT |
+                   (svc->append ? O_APPEND : O_TRUNC), 0666);
+    if (svc->fd >= 0) {
+        do {
+            len = write(svc->fd, svc->out, svc->out_len);
+        } while (len < 0 && errno == EINTR);
+    }
+
+    svc->out_len = 0;
+    if (svc->fd < 0 || len < 0) {
+        builtin_printf(svc, "sh: %s: %s\n", svc->redirect, strerror(errno));
+    }
+
+    if (svc->fd >= 0) {
+        close(svc->fd);
+        svc->fd = -1;
+    }
+
+    return BUILTIN_DONE;
+}
+
+static int builtin_ls_filter(const struct dirent *entry) {
+    return entry->d_name[0] != '.';
+}
+
+static int builtin_ls(ash_builtin_t *svc) {
+    const char *path = svc->argc > 1 ? svc->argv[1] : ".";
+    struct stat st;
+
+    if (svc->entries == NULL) {
+        if (stat(path, &st)) {
+            builtin_printf(svc, "ls: cannot access '%s': %s\n", path,
+                           strerror(errno));
+            return BUILTIN_DONE;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            builtin_printf(svc, "%s\n", path);
+            return BUILTIN_DONE;
+        }
+
+        svc->entries_count = scandir(path, &svc->entries,
+                                     builtin_ls_filter, alphasort);
+        if (svc->entries_count < 0) {
+            svc->entries = NULL;
+            builtin_printf(svc, "ls: %s: %s\n", path, strerror(errno));
+            return BUILTIN_DONE;
+        }
+    }
+
+    while (svc->entry < svc->entries_count) {
+        if (builtin_printf(svc, "%s\n", svc->entries[svc->entry]->d_name)) {
+            return BUILTIN_MORE;
+        }
+        svc->entry += 1;
+    }
+
+    return BUILTIN_DONE;
+}
+
+static int builtin_stat_file(ash_builtin_t *svc, const char *path) {
+    struct stat st;
+    const char *fmt;
+    size_t out_len = svc->out_len;
+    int ret = 0;
+
+    if (stat(path, &st)) {
+        return builtin_printf(svc, "stat: %s: %s\n", path, strerror(errno));
+    }
+
+    for (fmt = svc->argv[2]; *fmt && !ret; fmt++) {
+        if (*fmt != '%') {
+            ret = builtin_printf(svc, "%c", *fmt);
+            continue;
+        }
+
+        switch (*++fmt) {
+            case 'n':
+                ret = builtin_printf(svc, "%s", path);
+                break;
+            case 's':
+                ret = builtin_printf(svc, "%lld", (long long)st.st_size);
+                break;
+            case 'a':
+                ret = builtin_printf(svc, "%o", st.st_mode & 07777);
+                break;
+            case 'f':
+                ret = builtin_printf(svc, "%x", st.st_mode);
+                break;
+            case 'u':
+                ret = builtin_printf(svc, "%u", st.st_uid);
+                break;
+            case 'g':
+                ret = builtin_printf(svc, "%u", st.st_gid);
+                break;
+            case 'X':
+                ret = builtin_printf(svc, "%lld", (long long)st.st_atime);
+                break;
+            case 'Y':
+                ret = builtin_printf(svc, "%lld", (long long)st.st_mtime);
+                break;
+            case 'Z':
+                ret = builtin_printf(svc, "%lld", (long long)st.st_ctime);
+                break;
+            case 'h':
+                ret = builtin_printf(svc, "%lu", (unsigned long)st.st_nlink);
+                break;
+            case 'i':
+                ret = builtin_printf(svc, "%lu", (unsigned long)st.st_ino);
+                break;
+            default:
+                ret = builtin_printf(svc, "%%");
+                break;
+        }
+    }
+
+    if (!ret) {
+        ret = builtin_printf(svc, "\n");
+    }
+
+    if (ret) {
+        /* Line is generated again once buffer is sent */
+        svc->out_len = out_len;
+    }
+
+    return ret;
+}
+
+static int builtin_stat(ash_builtin_t *svc) {
+    if (svc->arg < 3) {
+        svc->arg = 3;
+    }
+
+    while (svc->arg < svc->argc) {
+        if (builtin_stat_file(svc, svc->argv[svc->arg])) {
+            return BUILTIN_MORE;
+        }
+        svc->arg += 1;
+    }
+
+    return BUILTIN_DONE;
+}
+
+static void builtin_free(ash_builtin_t *svc) {
+    int i;
+
+    if (svc->fd >= 0) {
+        close(svc->fd);
+    }
+
+    if (svc->entries != NULL) {
+        for (i = 0; i < svc->entries_count; i++) {
+            free(svc->entries[i]);
+        }
+        free(svc->entries);
+    }
+
+    free(svc);
+}
+
+/* Called from worker thread */
+
+static void builtin_work(void *arg) {
+    ash_builtin_t *svc = (ash_builtin_t*)arg;
+
+    if (!svc->opened && svc->cmd->prepare != NULL &&
+        svc->cmd->prepare(svc)) {
+        svc->spawn = 1;
+        return;
+    }
+
+    svc->done = svc->cmd->step(svc) == BUILTIN_DONE;
+}
+
+static int builtin_send(ash_builtin_t *svc, apacket *p) {
+    size_t len = svc->out_len - svc->out_pos;
+
+    if (len == 0) {
+        return -1;
+    }
+
+    if (len > CONFIG_ADBD_PAYLOAD_SIZE) {
+        len = CONFIG_ADBD_PAYLOAD_SIZE;
+    }
+
+    memcpy(p->data, svc->out + svc->out_pos, len);
+    p->write_len = len;
+    svc->out_pos += len;
+    return 0;
+}
+
+static int builtin_queue(ash_builtin_t *svc) {
+    svc->out_len = 0;
+    svc->out_pos = 0;
+
+    if (adb_hal_queue_work(svc->client, builtin_work,
+                           builtin_after_work, svc)) {
+        return -1;
+    }
+
+    svc->busy = 1;
+    return 0;
+}
+
+static void builtin_flush(ash_builtin_t *svc, apacket *p) {
+    if (p == NULL) {
+        /* Retried on kick */
+        p = adb_hal_apacket_allocate(svc->client);
+        if (p == NULL) {
+            return;
+        }
+    }
+
+    if (builtin_send(svc, p)) {
+        if (svc->done || builtin_queue(svc)) {
+            /* No more output */
+            adb_service_close(svc->client, &svc->service, p);
+            return;
+        }
+
+        svc->packet = p;
+        return;
+    }
+
+    svc->wait_ack = 1;
+    p->msg.arg0 = svc->service.id;
+    p->msg.arg1 = svc->service.peer_id;
+    adb_send_data_frame(svc->client, p);
+}
+
+static void builtin_spawn(ash_builtin_t *svc, apacket *p) {
+    adb_client_t *client = svc->client;
+    adb_service_t *shell;
+    unsigned peer_id = svc->service.peer_id;
+
+    shell = shell_service(client, svc->name);
+
+    if (shell == NULL) {
+        /* Local id must be zero in CLSE of a failed OPEN */
+        svc->service.id = 0;
+        adb_service_close(client, &svc->service, p);
+        return;
+    }
+
+    /* Host never learnt builtin id, OPEN is acknowledged by shell */
+    adb_service_close(client, &svc->service, NULL);
+
+    shell->peer_id = peer_id;
+    adb_register_service(shell, client);
+    adb_send_okay_frame(client, p, shell->id, shell->peer_id);
+
+    if (shell->ops->on_kick) {
+        shell->ops->on_kick(shell);
+    }
+}
+
+static int builtin_open(ash_builtin_t *svc) {
+    apacket *p;
+
+    p = adb_hal_apacket_allocate(svc->client);
+    if (p == NULL) {
+        /* Retried on kick */
+        return -1;
+    }
+
+    if (svc->spawn) {
+        /* Service is released */
+        builtin_spawn(svc, p);
+        return -1;
+    }
+
+    svc->opened = 1;
+    adb_send_okay_frame(svc->client, p, svc->service.id,
+                        svc->service.peer_id);
+    return 0;
+}
+
+static void builtin_after_work(void *arg) {
+    ash_builtin_t *svc = (ash_builtin_t*)arg;
+    apacket *p = svc->packet;
+
+    svc->busy = 0;
+    svc->packet = NULL;
+
+    if (svc->closed) {
+        builtin_free(svc);
+        return;
+    }
+
+    if (!svc->opened && builtin_open(svc)) {
+        return;
+    }
+
+    builtin_flush(svc, p);
+}
+
+static int builtin_write(adb_service_t *service, apacket *p) {
+    UNUSED(service);
+    UNUSED(p);
+
+    /* Host input is ignored */
+    return 0;
+}
+
+static int builtin_ack(adb_service_t *service, apacket *p) {
+    ash_builtin_t *svc = container_of(service, ash_builtin_t, service);
+
+    if (!svc->wait_ack) {
+        return 0;
+    }
+
+    if (!builtin_send(svc, p)) {
+        return 0;
+    }
+
+    svc->wait_ack = 0;
+
+    if (svc->done || builtin_queue(svc)) {
+        return -1;
+    }
+
+    /* Frame is sent once step is done */
+
+    svc->packet = p;
+    return 1;
+}
+
+static void builtin_kick(adb_service_t *service) {
+    ash_builtin_t *svc = container_of(service, ash_builtin_t, service);
+
+    if (svc->busy) {
+        return;
+    }
+
+    if (!svc->opened && builtin_open(svc)) {
+        return;
+    }
+
+    if (!svc->wait_ack) {
+        /* Frame allocation failed after last step */
+        builtin_flush(svc, NULL);
+    }
+}
+
+static void builtin_close(adb_service_t *service) {
+    ash_builtin_t *svc = container_of(service, ash_builtin_t, service);
+
+    if (svc->packet != NULL) {
+        adb_hal_apacket_release(svc->client, svc->packet);
+        svc->packet = NULL;
+    }
+
+    if (svc->busy) {
+        /* Released once step is done */
+        svc->closed = 1;
+        return;
+    }
+
+    builtin_free(svc);
+}
+
+static int builtin_is_self(const char *path) {
+    /* Would refer to daemon instead of command */
+
+    return !strncmp(path, "/proc/self/", 11) ||
+           !strncmp(path, "/proc/thread-self/", 18);
+}
+
+static int builtin_parse(ash_builtin_t *svc) {
+    char *arg;
+    char *save;
+    int target = 0;
+    unsigned i;
+
+    if (svc->line[strcspn(svc->line, BUILTIN_SPECIAL)] != 0) {
+        return -1;
+    }
+
+    /* Only output redirection at end of command line is accepted */
+
+    svc->argc = 0;
+    for (arg = strtok_r(svc->line, " \t", &save); arg != NULL;
+         arg = strtok_r(NULL, " \t", &save)) {
+        if (target) {
+            svc->redirect = arg;
+            target = 0;
+        }
+        else if (svc->redirect != NULL) {
+            return -1;
+        }
+        else if (arg[0] == '>' && svc->argc > 0) {
+            svc->append = arg[1] == '>';
+            arg += svc->append ? 2 : 1;
+            if (*arg == 0) {
+                target = 1;
+            }
+            else {
+                svc->redirect = arg;
+            }
+        }
+        else if (builtin_is_self(arg)) {
+            return -1;
+        }
+        else if (svc->argc < BUILTIN_ARGS) {
+            svc->argv[svc->argc++] = arg;
+        }
+        else {
+            return -1;
+        }
+
+        if (strchr(arg, '>') != NULL) {
+            return -1;
+        }
+    }
+
+    if (target || svc->argc == 0) {
+        return -1;
+    }
+
+    if (svc->redirect != NULL && builtin_is_self(svc->redirect)) {
+        return -1;
+    }
+
+    svc->argv[svc->argc] = NULL;
+
+    for (i = 0; i < sizeof(g_builtin_cmds) / sizeof(g_builtin_cmds[0]);
+         i++) {
+        if (!strcmp(svc->argv[0], g_builtin_cmds[i].name)) {
+            svc->cmd = &g_builtin_cmds[i];
+            return svc->cmd->check(svc);
+        }
+    }
+
+    return -1;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+adb_service_t *shell_builtin_service(adb_client_t *client,
+                                     const char *params, apacket *p) {
+    ash_builtin_t *svc;
+    const char *cmd;
+
+    cmd = strchr(params, ':');
+    if (cmd == NULL) {
+        return NULL;
+    }
+
+    cmd += 1;
+    svc = (ash_builtin_t *)malloc(sizeof(ash_builtin_t) + strlen(cmd) + 1 +
+                                  strlen(params) + 1);
+    if (svc == NULL) {
+        return NULL;
+    }
+
+    strcpy(svc->line, cmd);
+    svc->name = svc->line + strlen(cmd) + 1;
+    strcpy(svc->name, params);
+    svc->redirect = NULL;
+    svc->append = 0;
+
+    if (builtin_parse(svc)) {
+        free(svc);
+        return NULL;
+    }
+
+    svc->service.ops = &builtin_ops;
+    svc->client = client;
+    svc->arg = 1;
+    svc->fd = -1;
+    svc->entries = NULL;
+    svc->entries_count = 0;
+    svc->entry = 0;
+    svc->busy = 0;
+    svc->done = 0;
+    svc->closed = 0;
+    svc->wait_ack = 0;
+    svc->opened = svc->cmd->prepare == NULL;
+    svc->spawn = 0;
+    svc->packet = NULL;
+
+    if (builtin_queue(svc)) {
+        free(svc);
+        return NULL;
+    }
+
+    if (!svc->opened) {
+        /* OPEN is acknowledged once command is prepared */
+        p->write_len = APACKET_SERVICE_INIT_ASYNC;
+    }
+
+    return &svc->service;
+}
@@ -25,6 +25,7 @@
  ****************************************************************************/
 
 #define ADB_SHELL_PREFIX "shell:"
+#define ADB_EXEC_PREFIX  "exec:"
 
 /****************************************************************************
  * Public Function Prototypes
@@ -32,4 +33,9 @@
 
 adb_service_t* shell_service(adb_client_t *client, const char *params);
 
+/* Run command in daemon if it is a known builtin, NULL otherwise */
+
+adb_service_t* shell_builtin_service(adb_client_t *client,
+                                     const char *params, apacket *p);
+
 #endif /* _SHELL_SERVICE_H_ */
@@ -41,6 +41,14 @@ typedef struct adb_stream_service_s {
     adb_client_t *client;
     adb_tcp_socket_t socket;
     enum stream_state state;
+    /* Host data written to socket not completed yet. Their frames are
+     * no longer counted for client once service is closed. */
+    unsigned write_pending;
+    uint8_t closed;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    /* Host data queued to socket and already acknowledged */
+    size_t write_queued;
+#endif
 } adb_stream_service_t;
 
 typedef struct atcp_fstream_service_s {
@@ -156,6 +164,27 @@ static void stream_send_data_frame_cb(adb_client_t *client, adb_tcp_socket_t *so
     adb_stream_service_t *svc =
         container_of(socket, adb_stream_service_t, socket);
 
+    svc->write_pending -= 1;
+    if (svc->closed) {
+        /* Write cancelled by close, client may be gone already */
+        free(container_of(p, apacket_uv_t, p));
+        return;
+    }
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (p->write_len > 0) {
+        /* Frame was acknowledged once queued */
+        svc->write_queued -= p->write_len;
+        p->write_len = 0;
+
+        if (fail)
+            adb_service_close(client, &svc->service, p);
+        else
+            adb_hal_apacket_release(client, p);
+        return;
+    }
+#endif
+
     if (fail)
         adb_service_close(client, &svc->service, p);
     else
@@ -166,17 +195,48 @@ static int atcp_stream_on_write(adb_service_t *service, apacket *p) {
     int ret;
     adb_stream_service_t *svc =
         container_of(service, adb_stream_service_t, service);
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    apacket *okay = NULL;
+#endif
 
     if (svc->state < F_CONNECTED)
         return -1;
 
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    /* Acknowledge now so that host sends next frame while this one is
+     * written. Otherwise ack is deferred until write is done. */
+
+    p->write_len = 0;
+    if (svc->write_queued + p->msg.data_length <= CONFIG_ADBD_WRITE_BUDGET) {
+        okay = adb_hal_apacket_allocate(svc->client);
+        if (okay != NULL) {
+            p->write_len = p->msg.data_length;
+        }
+    }
+#endif
+
     ret = adb_hal_socket_write(&svc->socket, p, stream_send_data_frame_cb);
 
     if (ret < 0) {
         adb_err("adb_hal_socket_write failed (ret=%d, errno=%d)\n", ret, errno);
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+        if (okay != NULL) {
+            adb_hal_apacket_release(svc->client, okay);
+        }
+#endif
         return -1;
     }
 
+    svc->write_pending += 1;
+
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    if (okay != NULL) {
+        svc->write_queued += p->write_len;
+        adb_send_okay_frame(svc->client, okay, svc->service.id,
+                            svc->service.peer_id);
+    }
+#endif
+
     /* Notify client packet requires async processing */
     return 1;
 }
@@ -191,6 +251,10 @@ static void atcp_stream_on_close(struct adb_service_s *service) {
     adb_stream_service_t *svc =
         container_of(service, adb_stream_service_t, service);
 
+    svc->closed = 1;
+    adb_uv_packet_disown(container_of(svc->client, adb_client_uv_t, client),
+                         svc->write_pending);
+
     if (svc->state > F_NOT_CONNECTED) {
         adb_hal_socket_close(&svc->socket, atcp_stream_release);
     }
@@ -237,6 +301,11 @@ adb_service_t* tcp_forward_service(adb_client_t *client, const char *params, apa
 
     fsvc->stream_service.client = client;
     fsvc->stream_service.state = F_NOT_CONNECTED;
+    fsvc->stream_service.write_pending = 0;
+    fsvc->stream_service.closed = 0;
+#ifdef CONFIG_ADBD_WRITE_BUDGET
+    fsvc->stream_service.write_queued = 0;
+#endif
 
     adb_log("connect to port %d\n", port);
     ret = adb_hal_socket_connect(client,